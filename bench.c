@@ -0,0 +1,161 @@
+/* Multi-threaded scaling benchmark for the `finally` module: every
+ * thread runs `finally` in a tight loop in its own Lua state (every
+ * other call in debug mode), so any hidden state shared between Lua
+ * states shows up as bad scaling or as a data race.
+ *
+ *   cc -O2 -pthread -I/usr/include/lua5.4 -o bench bench.c -llua5.4
+ *   ./bench [iterations per thread [max. number of threads]]
+ *
+ * To look for data races, it can also be built manually with
+ * ThreadSanitizer (this is not part of any automated build):
+ *
+ *   cc -g -O1 -fsanitize=thread -pthread -I/usr/include/lua5.4 \
+ *      -o bench-tsan bench.c -llua5.4
+ *   ./bench-tsan 10000
+ *
+ * (ThreadSanitizer exits with a non-zero status if it finds a data
+ * race.) The same works with `-DFINALLY_STATS` for the process-wide
+ * statistics.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#  define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "finally.c"
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <lualib.h>
+
+
+static char const bench_code[] =
+  "local finally = require( 'finally' )\n"
+  "local n = ...\n"
+  "local x = 0\n"
+  "local function main() x = x + 1 end\n"
+  "local function cleanup() end\n"
+  "for i = 1, n do\n"
+  "  finally( main, cleanup, 100, 10, i % 2 == 0 )\n"
+  "end\n"
+  "return x\n";
+
+
+typedef struct {
+  lua_State* L;
+  long       n;
+  int        ok;
+  pthread_t  thread;
+} worker;
+
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start = PTHREAD_COND_INITIALIZER;
+static int go = 0;
+
+
+static double now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void* run( void* p ) {
+  worker* w = p;
+  pthread_mutex_lock( &lock );
+  while( !go )
+    pthread_cond_wait( &start, &lock );
+  pthread_mutex_unlock( &lock );
+  if( lua_pcall( w->L, 1, 1, 0 ) != 0 )
+    fprintf( stderr, "error: %s\n", lua_tostring( w->L, -1 ) );
+  else
+    w->ok = (long)lua_tonumber( w->L, -1 ) == w->n;
+  return NULL;
+}
+
+
+/* run `nthreads` threads and return the number of calls per second,
+ * or a negative number on error */
+static double bench( int nthreads, long n ) {
+  worker* w = calloc( nthreads, sizeof( worker ) );
+  double t0 = 0, t1 = 0;
+  int i = 0, ok = 1;
+  if( w == NULL )
+    return -1;
+  for( i = 0; i < nthreads; i++ ) {
+    w[ i ].n = n;
+    w[ i ].L = luaL_newstate();
+    if( w[ i ].L == NULL ) {
+      fprintf( stderr, "error: cannot create Lua state\n" );
+      while( --i >= 0 )
+        lua_close( w[ i ].L );
+      free( w );
+      return -1;
+    }
+    luaL_openlibs( w[ i ].L );
+    lua_getglobal( w[ i ].L, "package" );
+    lua_getfield( w[ i ].L, -1, "preload" );
+    lua_pushcfunction( w[ i ].L, luaopen_finally );
+    lua_setfield( w[ i ].L, -2, "finally" );
+    lua_pop( w[ i ].L, 2 );
+    if( luaL_loadstring( w[ i ].L, bench_code ) != 0 ) {
+      fprintf( stderr, "error: %s\n", lua_tostring( w[ i ].L, -1 ) );
+      for( ; i >= 0; i-- )
+        lua_close( w[ i ].L );
+      free( w );
+      return -1;
+    }
+    lua_pushnumber( w[ i ].L, (lua_Number)n );
+  }
+  go = 0;
+  for( i = 0; i < nthreads; i++ )
+    pthread_create( &w[ i ].thread, NULL, run, w+i );
+  pthread_mutex_lock( &lock );
+  go = 1;
+  t0 = now();
+  pthread_cond_broadcast( &start );
+  pthread_mutex_unlock( &lock );
+  for( i = 0; i < nthreads; i++ )
+    pthread_join( w[ i ].thread, NULL );
+  t1 = now();
+  for( i = 0; i < nthreads; i++ ) {
+    ok = ok && w[ i ].ok;
+    lua_close( w[ i ].L );
+  }
+  free( w );
+  return ok ? nthreads * n / (t1-t0) : -1;
+}
+
+
+int main( int argc, char* argv[] ) {
+  long n = argc > 1 ? atol( argv[ 1 ] ) : 200000;
+  long maxthreads = argc > 2 ? atol( argv[ 2 ] ) :
+                               sysconf( _SC_NPROCESSORS_ONLN );
+  double base = 0;
+  int t = 1;
+  if( n < 1 || maxthreads < 1 ) {
+    fprintf( stderr, "usage: %s [iterations [threads]]\n", argv[ 0 ] );
+    return EXIT_FAILURE;
+  }
+  printf( "%8s %14s %8s %10s\n", "threads", "calls/s", "speedup",
+          "efficiency" );
+  for( t = 1; ; t *= 2 ) {
+    double r = 0;
+    if( t > maxthreads )
+      t = (int)maxthreads;
+    r = bench( t, n );
+    if( r < 0 ) {
+      fprintf( stderr, "benchmark failed with %d threads\n", t );
+      return EXIT_FAILURE;
+    }
+    if( t == 1 )
+      base = r;
+    printf( "%8d %14.0f %8.2f %9.0f%%\n", t, r, r/base,
+            100.0*r/(base*t) );
+    if( t == maxthreads )
+      break;
+  }
+  return EXIT_SUCCESS;
+}
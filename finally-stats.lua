@@ -0,0 +1,92 @@
+#!/usr/bin/lua
+-- Prints the statistics that processes using the C version of the
+-- `finally` module (compiled with FINALLY_STATS) publish in shared
+-- memory (see README.md).
+--
+-- Usage: lua finally-stats.lua [file...]
+-- (default: all `finally.*` files in $FINALLY_SHM or /dev/shm)
+
+local names = {
+  "calls", "errors", "cleanup_errors",
+  "prealloc_ns", "main_ns", "cleanup_ns"
+}
+
+
+-- decode an unsigned integer of `n` bytes at position `i`
+local function uint( s, i, n, le )
+  local v = 0
+  for j = 0, n-1 do
+    local b = le and s:byte( i+n-1-j ) or s:byte( i+j )
+    v = v * 256 + b
+  end
+  return v
+end
+
+
+local function read( path )
+  local f = io.open( path, "rb" )
+  if not f then return nil end
+  local s = f:read( "*a" )
+  f:close()
+  if #s < 64 or s:sub( 1, 8 ) ~= "FINSTATS" then return nil end
+  local le = s:byte( 9 ) ~= 0
+  if uint( s, 9, 4, le ) ~= 1 then return nil end -- unknown version
+  local nshards, ncounters = uint( s, 13, 4, le ), uint( s, 17, 4, le )
+  local nbuckets, size = uint( s, 21, 4, le ), uint( s, 25, 4, le )
+  local st = { pid = uint( s, 33, 8, le ), hist = {} }
+  if #s < 64 + nshards*size then return nil end
+  for i = 1, ncounters + nbuckets do
+    local sum = 0
+    for j = 0, nshards-1 do
+      sum = sum + uint( s, 65 + j*size + (i-1)*8, 8, le )
+    end
+    if i <= ncounters then
+      st[ names[ i ] or i ] = sum
+    else
+      st.hist[ i-ncounters ] = sum
+    end
+  end
+  return st
+end
+
+
+local function show( label, st )
+  local t = {}
+  for _,n in ipairs( names ) do
+    t[ #t+1 ] = n .. "=" .. ("%.0f"):format( st[ n ] or 0 )
+  end
+  print( label, table.concat( t, " " ) )
+  for k,n in ipairs( st.hist ) do
+    if n > 0 then
+      print( "", ("cleanup >= %.0fns"):format( 2^(k-1) ),
+             ("%.0f"):format( n ) )
+    end
+  end
+end
+
+
+local files = { ... }
+if #files == 0 then
+  local dir = os.getenv( "FINALLY_SHM" ) or "/dev/shm"
+  local quoted = "'" .. dir:gsub( "'", "'\\''" ) .. "'"
+  local p = io.popen( "ls -1d -- " .. quoted .. "/finally.* 2>/dev/null" )
+  for line in p:lines() do files[ #files+1 ] = line end
+  p:close()
+end
+local total = { hist = {} }
+for _,path in ipairs( files ) do
+  local st = read( path )
+  if st then
+    local f = io.open( ("/proc/%.0f/stat"):format( st.pid ) )
+    local alive = f ~= nil
+    if f then f:close() end
+    show( ("%.0f%s"):format( st.pid, alive and "" or " (exited)" ), st )
+    for _,n in ipairs( names ) do
+      total[ n ] = (total[ n ] or 0) + st[ n ]
+    end
+    for k,n in ipairs( st.hist ) do
+      total.hist[ k ] = (total.hist[ k ] or 0) + n
+    end
+  end
+end
+show( "total", total )
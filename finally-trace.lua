@@ -0,0 +1,83 @@
+#!/usr/bin/lua
+-- Decodes a trace file written by the C version of the `finally`
+-- module (compiled with FINALLY_TRACE, see README.md), e.g. after
+-- the process has crashed. Calls that were still running are marked
+-- with "in main" or "in cleanup".
+--
+-- Usage: lua finally-trace.lua file
+
+
+-- decode an unsigned integer of `n` bytes at position `i`
+local function uint( s, i, n, le )
+  local v = 0
+  for j = 0, n-1 do
+    local b = le and s:byte( i+n-1-j ) or s:byte( i+j )
+    v = v * 256 + b
+  end
+  return v
+end
+
+
+local path = ...
+if not path then
+  io.stderr:write( "usage: lua finally-trace.lua file\n" )
+  os.exit( 1 )
+end
+local f = assert( io.open( path, "rb" ) )
+local s = f:read( "*a" )
+f:close()
+if #s < 64 or s:sub( 1, 8 ) ~= "FINTRACE" then
+  error( path .. ": not a trace file" )
+end
+local le = s:byte( 9 ) ~= 0
+if uint( s, 9, 4, le ) ~= 1 then
+  error( path .. ": unsupported version" )
+end
+local size, n = uint( s, 13, 4, le ), uint( s, 17, 8, le )
+print( ("pid %.0f, %.0f calls"):format( uint( s, 25, 8, le ),
+                                        uint( s, 33, 8, le ) ) )
+
+local records = {}
+for i = 0, n-1 do
+  local o = 65 + i*size
+  if o+size-1 > #s then break end
+  local seq = uint( s, o, 8, le )
+  if seq > 0 then
+    records[ #records+1 ] = {
+      seq = seq,
+      start = uint( s, o+8, 8, le ),
+      id = uint( s, o+16, 8, le ),
+      main_ns = uint( s, o+24, 8, le ),
+      cleanup_ns = uint( s, o+32, 8, le ),
+      phase = s:byte( o+40 ),
+      status = s:byte( o+41 ),
+      status2 = s:byte( o+42 ),
+    }
+  end
+end
+table.sort( records, function( a, b ) return a.seq < b.seq end )
+
+print( "seq", "scope", "start", "", "main ns", "cleanup ns", "state" )
+for _,r in ipairs( records ) do
+  local state
+  if r.phase == 1 then
+    state = "in main"
+  elseif r.phase == 2 then
+    state = "in cleanup"
+  elseif r.status2 ~= 0 then
+    state = "cleanup error"
+  elseif r.status ~= 0 then
+    state = "main error"
+  else
+    state = "ok"
+  end
+  -- (timestamps exceed the precision of doubles, so only print
+  -- microseconds)
+  local sec = math.floor( r.start / 1e9 )
+  local usec = math.max( 0, math.floor( (r.start - sec*1e9) / 1e3 ) )
+  print( ("%.0f"):format( r.seq ), ("%.0f"):format( r.id ),
+         os.date( "!%Y-%m-%d %H:%M:%S", sec ), ("%06d"):format( usec ),
+         r.phase > 1 and ("%.0f"):format( r.main_ns ) or "-",
+         r.phase > 2 and ("%.0f"):format( r.cleanup_ns ) or "-",
+         state )
+end
@@ -2,7 +2,27 @@
  * resource cleanup.
  */
 
+/* `finally.mmap` is available on POSIX systems unless FINALLY_MMAP
+ * is defined to 0 */
+#if !defined( FINALLY_MMAP ) && (defined( __unix__ ) || \
+                                 defined( __APPLE__ ))
+#  define FINALLY_MMAP 1
+#endif
+
+/* clock_gettime(), mmap(), etc. for the process-wide statistics, the
+ * trace file, and memory-mapped files */
+#if (defined( FINALLY_STATS ) || defined( FINALLY_TRACE ) || \
+     (defined( FINALLY_MMAP ) && FINALLY_MMAP)) && \
+    !defined( _POSIX_C_SOURCE )
+#  define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
 #include <lua.h>
 #include <lauxlib.h>
 
@@ -13,6 +33,44 @@
 #define lua_resume( L2, L, na, nr ) \
   ((void)(L), (void)(nr), lua_resume( L2, na ))
 
+#define lua_getuservalue( L, i ) lua_getfenv( L, i )
+#define lua_setuservalue( L, i ) lua_setfenv( L, i )
+
+/* (LuaJIT 2.1 has its own `luaL_setfuncs`) */
+#define luaL_setfuncs( L, l, nup ) compat_setfuncs( L, l, nup )
+
+static void compat_setfuncs( lua_State* L, luaL_Reg const* l, int nup ) {
+  luaL_checkstack( L, nup+1, "too many upvalues" );
+  for( ; l->name != NULL; l++ ) {
+    int i = 0;
+    lua_pushstring( L, l->name );
+    for( i = 0; i < nup; i++ )
+      lua_pushvalue( L, -(nup+1) );
+    lua_pushcclosure( L, l->func, nup );
+    lua_settable( L, -(nup+3) );
+  }
+  lua_pop( L, nup );
+}
+
+/* (LuaJIT 2.1 has its own `luaL_fileresult`) */
+#define luaL_fileresult( L, stat, fname ) compat_fileresult( L, stat, fname )
+
+static int compat_fileresult( lua_State* L, int stat,
+                              char const* fname ) {
+  int en = errno;
+  if( stat ) {
+    lua_pushboolean( L, 1 );
+    return 1;
+  }
+  lua_pushnil( L );
+  if( fname )
+    lua_pushfstring( L, "%s: %s", fname, strerror( en ) );
+  else
+    lua_pushstring( L, strerror( en ) );
+  lua_pushinteger( L, en );
+  return 3;
+}
+
 #elif LUA_VERSION_NUM == 502 /* Lua 5.2 */
 
 #define lua_resume( L2, L, na, nr ) \
@@ -51,6 +109,12 @@ typedef int lua_KContext;
 #define LUA_KFUNCTION( _name ) \
   static int (_name)( lua_State* L, int status, lua_KContext ctx )
 
+#if LUA_VERSION_RELEASE_NUM >= 50406
+#define close_thread( co, L ) lua_closethread( co, L )
+#else
+#define close_thread( co, L ) lua_resetthread( co )
+#endif
+
 #else
 
 #error unsupported Lua version
@@ -58,6 +122,619 @@ typedef int lua_KContext;
 #endif /* LUA_VERSION_NUM */
 
 
+/* size of the buffer for log messages from cleanup functions */
+#ifndef FINALLY_LOGSIZE
+#  define FINALLY_LOGSIZE 1024
+#endif
+
+
+/* max. number of distinct cleanup allocation sites in observe mode */
+#ifndef FINALLY_SITES
+#  define FINALLY_SITES 32
+#endif
+
+
+/* size of the hash table for sampled stacks of cleanup functions,
+ * and max. length of a collapsed stack */
+#ifndef FINALLY_STACKS
+#  define FINALLY_STACKS 64
+#endif
+#ifndef FINALLY_STACKLEN
+#  define FINALLY_STACKLEN 512
+#endif
+
+
+/* size of the hash table for profiling allocations of main
+ * functions (should be a power of 2) */
+#ifndef FINALLY_SCOPES
+#  define FINALLY_SCOPES 64
+#endif
+
+
+/* number of results of the main function reserved for the cleanup
+ * function if the `results` option is `true` */
+#ifndef FINALLY_RESULTS
+#  define FINALLY_RESULTS 8
+#endif
+
+
+/* size of the memory blocks for scratch buffers */
+#ifndef FINALLY_ARENASIZE
+#  define FINALLY_ARENASIZE 4096
+#endif
+
+
+/* static tracepoints (USDT) for bpftrace, perf, SystemTap, etc.;
+ * disabled probes are a single NOP */
+#ifndef FINALLY_SDT
+#  if defined( __has_include )
+#    if __has_include( <sys/sdt.h> )
+#      define FINALLY_SDT 1
+#    endif
+#  endif
+#endif
+#ifndef FINALLY_SDT
+#  define FINALLY_SDT 0
+#endif
+
+#if FINALLY_SDT
+#  include <sys/sdt.h>
+#  define PROBE1( _n, _a ) DTRACE_PROBE1( finally, _n, _a )
+#  define PROBE2( _n, _a, _b ) DTRACE_PROBE2( finally, _n, _a, _b )
+#  define PROBE3( _n, _a, _b, _c ) \
+  DTRACE_PROBE3( finally, _n, _a, _b, _c )
+#else
+#  define PROBE1( _n, _a ) ((void)0)
+#  define PROBE2( _n, _a, _b ) ((void)0)
+#  define PROBE3( _n, _a, _b, _c ) ((void)0)
+#endif
+
+
+/* optional process-wide statistics aggregated over all Lua states
+ * (and OS threads); every thread gets its own cache line of counters
+ * (unless there are more than FINALLY_SHARDS threads), so updating
+ * them doesn't cause any cross-core contention. Requires GCC/Clang
+ * atomics, thread-local storage, and a POSIX clock. */
+#ifndef FINALLY_STATS
+#  define FINALLY_STATS 0
+#endif
+
+/* optional trace of `finally` calls in a memory-mapped file that
+ * survives crashes of the process */
+#ifndef FINALLY_TRACE
+#  define FINALLY_TRACE 0
+#endif
+
+#ifndef FINALLY_MMAP
+#  define FINALLY_MMAP 0
+#endif
+
+
+#if FINALLY_STATS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if FINALLY_STATS || FINALLY_TRACE || FINALLY_MMAP
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+
+#if FINALLY_STATS || FINALLY_TRACE
+
+/* create (or open) a file with the given size and map it into
+ * memory; returns NULL (and sets errno) on error */
+static void* map_file( char const* path, size_t size ) {
+  void* p = MAP_FAILED;
+  int fd = open( path, O_RDWR | O_CREAT, 0644 );
+  if( fd < 0 )
+    return NULL;
+  if( ftruncate( fd, (off_t)size ) == 0 )
+    p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if( p == MAP_FAILED ) {
+    int e = errno;
+    close( fd );
+    errno = e;
+    return NULL;
+  }
+  close( fd );
+  return p;
+}
+
+#endif
+
+
+#if FINALLY_STATS
+
+#ifndef FINALLY_SHARDS
+#  define FINALLY_SHARDS 64
+#endif
+
+#define STATS_VERSION 1
+#define STATS_BUCKETS 32 /* log2 histogram of cleanup nanoseconds */
+
+enum {
+  STAT_CALLS,
+  STAT_ERRORS, /* errors in main functions */
+  STAT_CLEANUP_ERRORS, /* errors in cleanup functions */
+  STAT_PREALLOC_NS,
+  STAT_MAIN_NS,
+  STAT_CLEANUP_NS,
+  STAT_COUNT
+};
+
+static char const* const stat_names[ STAT_COUNT ] = {
+  "calls", "errors", "cleanup_errors",
+  "prealloc_ns", "main_ns", "cleanup_ns"
+};
+
+typedef unsigned long long stat_time;
+
+typedef union {
+  stat_time c[ STAT_COUNT+STATS_BUCKETS ];
+  char      pad[ ((STAT_COUNT+STATS_BUCKETS)*8+63)/64*64 ];
+} stats_shard;
+
+/* header of the shared memory file (followed by the shards) */
+typedef union {
+  struct {
+    char      magic[ 8 ]; /* "FINSTATS" */
+    unsigned  version;
+    unsigned  nshards;
+    unsigned  ncounters;
+    unsigned  nbuckets;
+    unsigned  shardsize;
+    stat_time pid;
+  } h;
+  char pad[ 64 ];
+} stats_header;
+
+static stats_shard stats_local[ FINALLY_SHARDS ]
+  __attribute__(( aligned( 64 ) ));
+static stats_shard* stats = stats_local; /* or in shared memory */
+static unsigned stats_next = 0;
+static int stats_init = 0; /* 1 = in progress, 2 = done */
+static void* stats_map = NULL; /* shared memory file, if any */
+static int stats_atfork = 0;
+static int stats_reopen = 0; /* set in a forked child */
+static __thread int stats_mine = -1;
+
+
+static void stats_child( void );
+
+
+static void stats_add( int i, stat_time v ) {
+  stats_shard* st = NULL;
+  if( __atomic_load_n( &stats_reopen, __ATOMIC_RELAXED ) &&
+      __atomic_exchange_n( &stats_reopen, 0, __ATOMIC_ACQ_REL ) )
+    stats_child();
+  st = __atomic_load_n( &stats, __ATOMIC_ACQUIRE );
+  if( stats_mine < 0 )
+    stats_mine = (int)(__atomic_fetch_add( &stats_next, 1,
+                                           __ATOMIC_RELAXED ) %
+                       FINALLY_SHARDS);
+  __atomic_fetch_add( &st[ stats_mine ].c[ i ], v, __ATOMIC_RELAXED );
+}
+
+
+static void stats_hist( stat_time ns ) {
+  int k = 0;
+  while( ns > 1 && k < STATS_BUCKETS-1 ) {
+    ns >>= 1;
+    k++;
+  }
+  stats_add( STAT_COUNT+k, 1 );
+}
+
+
+static stat_time stats_now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (stat_time)ts.tv_sec*1000000000u + (stat_time)ts.tv_nsec;
+}
+
+
+static stat_time stats_sum( int i ) {
+  stats_shard* st = __atomic_load_n( &stats, __ATOMIC_ACQUIRE );
+  stat_time sum = 0;
+  int j = 0;
+  for( j = 0; j < FINALLY_SHARDS; j++ )
+    sum += __atomic_load_n( &st[ j ].c[ i ], __ATOMIC_RELAXED );
+  return sum;
+}
+
+
+/* if the environment variable FINALLY_SHM names a directory, the
+ * counters are moved to the file `$FINALLY_SHM/finally.<pid>`, so
+ * that external tools can read them (see `finally-stats.lua`). The
+ * file is left behind when the process exits. */
+static void stats_shm( void );
+
+
+/* after fork() the child gets new counters (in a file of its own);
+ * the fork handler only switches to zeroed local counters (it must be
+ * async-signal-safe), and the file is created on the first update */
+static void stats_fork( void ) {
+  memset( stats_local, 0, sizeof( stats_local ) );
+  __atomic_store_n( &stats, stats_local, __ATOMIC_RELEASE );
+  __atomic_store_n( &stats_reopen, 1, __ATOMIC_RELEASE );
+}
+
+
+static void stats_child( void ) {
+  size_t size = sizeof( stats_header ) + sizeof( stats_local );
+  stats_shard* st = NULL;
+  int i = 0, j = 0;
+  if( stats_map != NULL ) {
+    munmap( stats_map, size ); /* the parent's file */
+    stats_map = NULL;
+  }
+  stats_shm();
+  /* move the counts made in the meantime to the new file */
+  st = __atomic_load_n( &stats, __ATOMIC_ACQUIRE );
+  if( st != stats_local )
+    for( i = 0; i < FINALLY_SHARDS; i++ )
+      for( j = 0; j < STAT_COUNT+STATS_BUCKETS; j++ )
+        __atomic_fetch_add( &st[ i ].c[ j ],
+                            __atomic_exchange_n( &stats_local[ i ].c[ j ],
+                                                 0, __ATOMIC_RELAXED ),
+                            __ATOMIC_RELAXED );
+}
+
+
+static void stats_shm( void ) {
+  char const* dir = getenv( "FINALLY_SHM" );
+  size_t size = sizeof( stats_header ) + sizeof( stats_local );
+  stats_header* hdr = NULL;
+  void* p = NULL;
+  char path[ 256 ];
+  if( dir == NULL || *dir == '\0' || strlen( dir ) > sizeof( path )-32 )
+    return;
+  sprintf( path, "%s/finally.%lu", dir, (unsigned long)getpid() );
+  p = map_file( path, size );
+  if( p == NULL )
+    return;
+  if( !stats_atfork ) {
+    pthread_atfork( NULL, NULL, stats_fork );
+    stats_atfork = 1;
+  }
+  stats_map = p;
+  hdr = p;
+  /* the file may be left over by an earlier process with this pid */
+  memset( p, 0, size );
+  memcpy( hdr->h.magic, "FINSTATS", 8 );
+  hdr->h.nshards = FINALLY_SHARDS;
+  hdr->h.ncounters = STAT_COUNT;
+  hdr->h.nbuckets = STATS_BUCKETS;
+  hdr->h.shardsize = sizeof( stats_shard );
+  hdr->h.pid = (stat_time)getpid();
+  __atomic_store_n( &hdr->h.version, STATS_VERSION, __ATOMIC_RELEASE );
+  __atomic_store_n( &stats, (stats_shard*)(hdr+1), __ATOMIC_RELEASE );
+}
+
+
+/* called by every `luaopen_finally`: the first call sets up the
+ * counters, and concurrent calls wait until the counters have been
+ * published, so that no counts end up in the wrong shards */
+static void stats_open( void ) {
+  int expected = 0;
+  if( __atomic_load_n( &stats_init, __ATOMIC_ACQUIRE ) == 2 )
+    return;
+  if( __atomic_compare_exchange_n( &stats_init, &expected, 1, 0,
+                                   __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE ) ) {
+    stats_shm();
+    __atomic_store_n( &stats_init, 2, __ATOMIC_RELEASE );
+  } else {
+    while( __atomic_load_n( &stats_init, __ATOMIC_ACQUIRE ) != 2 )
+      sched_yield();
+  }
+}
+
+
+/* `finally.stats()` returns a table with the process-wide counters */
+static int lstats( lua_State* L ) {
+  int i = 0;
+  lua_createtable( L, 0, STAT_COUNT+1 );
+  for( i = 0; i < STAT_COUNT; i++ ) {
+    lua_pushinteger( L, (lua_Integer)stats_sum( i ) );
+    lua_setfield( L, -2, stat_names[ i ] );
+  }
+  lua_createtable( L, STATS_BUCKETS, 0 );
+  for( i = 0; i < STATS_BUCKETS; i++ ) {
+    lua_pushinteger( L, (lua_Integer)stats_sum( STAT_COUNT+i ) );
+    lua_rawseti( L, -2, i+1 );
+  }
+  lua_setfield( L, -2, "cleanup_hist" );
+  return 1;
+}
+
+#  define STATS_NOW( _t ) ((_t) = stats_now())
+#  define STATS_ADD( _i, _v ) stats_add( _i, _v )
+#  define STATS_HIST( _ns ) stats_hist( _ns )
+#else
+#  define STATS_NOW( _t ) ((void)0)
+#  define STATS_ADD( _i, _v ) ((void)0)
+#  define STATS_HIST( _ns ) ((void)0)
+typedef int stat_time; /* unused */
+#endif
+
+
+#if FINALLY_TRACE
+
+#define TRACE_NAME "finally.trace"
+#define TRACE_VERSION 1
+
+typedef unsigned long long trace_u64;
+
+/* record of a `finally` call in the trace file */
+typedef struct {
+  trace_u64     seq; /* sequence number (0 = unused/incomplete) */
+  trace_u64     start; /* wall clock time in nanoseconds */
+  trace_u64     id; /* scope id */
+  trace_u64     main_ns;
+  trace_u64     cleanup_ns;
+  unsigned char phase; /* 1 = in main, 2 = in cleanup, 3 = done */
+  unsigned char status; /* of the main function */
+  unsigned char status2; /* of the cleanup function */
+  unsigned char pad[ 5 ];
+} trace_record;
+
+/* header of the trace file (followed by the records) */
+typedef union {
+  struct {
+    char      magic[ 8 ]; /* "FINTRACE" */
+    unsigned  version;
+    unsigned  recordsize;
+    trace_u64 nrecords;
+    trace_u64 pid;
+    trace_u64 seq; /* last used sequence number */
+  } h;
+  char pad[ 64 ];
+} trace_header;
+
+/* userdata for the trace file of a Lua state */
+typedef struct {
+  trace_header* hdr; /* NULL if tracing is off */
+  size_t        size; /* of the mapping */
+  size_t        gen; /* incremented on every (un)mapping */
+} trace_ring;
+
+/* the record of an active `finally` call (lives on the C stack) */
+typedef struct {
+  trace_ring*   ring;
+  trace_record* r;
+  size_t        gen;
+  trace_u64     seq;
+  trace_u64     t;
+} trace_call;
+
+
+static trace_u64 trace_now( void ) {
+  struct timespec ts;
+  clock_gettime( CLOCK_REALTIME, &ts );
+  return (trace_u64)ts.tv_sec*1000000000u + (trace_u64)ts.tv_nsec;
+}
+
+
+/* the hot path: just a few stores into the mapped file */
+static void trace_begin( trace_ring* t, trace_call* c, size_t id ) {
+  trace_record* r = NULL;
+  c->ring = t;
+  c->r = NULL;
+  if( t == NULL || t->hdr == NULL )
+    return;
+  c->gen = t->gen;
+  c->seq = ++t->hdr->h.seq;
+  r = (trace_record*)(t->hdr+1) + (c->seq-1) % t->hdr->h.nrecords;
+  r->seq = 0;
+  r->start = c->t = trace_now();
+  r->id = id;
+  r->main_ns = 0;
+  r->cleanup_ns = 0;
+  r->phase = 1;
+  r->status = 0;
+  r->status2 = 0;
+  r->seq = c->seq;
+  c->r = r;
+}
+
+
+/* the record may have been overwritten by nested calls, or the file
+ * may have been unmapped in the meantime */
+static trace_record* trace_check( trace_call* c ) {
+  if( c->r != NULL && c->ring->gen == c->gen && c->r->seq == c->seq )
+    return c->r;
+  return NULL;
+}
+
+
+static void trace_main( trace_call* c, int status ) {
+  trace_record* r = trace_check( c );
+  if( r != NULL ) {
+    trace_u64 now = trace_now();
+    r->main_ns = now - c->t;
+    r->status = (unsigned char)status;
+    r->phase = 2;
+    c->t = now;
+  }
+}
+
+
+static void trace_end( trace_call* c, int status2 ) {
+  trace_record* r = trace_check( c );
+  if( r != NULL ) {
+    r->cleanup_ns = trace_now() - c->t;
+    r->status2 = (unsigned char)status2;
+    r->phase = 3;
+  }
+}
+
+
+static void trace_unmap( trace_ring* t ) {
+  if( t->hdr != NULL ) {
+    munmap( (void*)t->hdr, t->size );
+    t->hdr = NULL;
+    t->gen++;
+  }
+}
+
+
+static int trace_gc( lua_State* L ) {
+  trace_unmap( lua_touserdata( L, 1 ) );
+  return 0;
+}
+
+#  define TRACE_BEGIN( _ms, _c, _id ) trace_begin( (_ms)->trace, _c, _id )
+#  define TRACE_MAIN( _c, _s ) trace_main( _c, _s )
+#  define TRACE_END( _c, _s ) trace_end( _c, _s )
+#else
+#  define TRACE_BEGIN( _ms, _c, _id ) ((void)0)
+#  define TRACE_MAIN( _c, _s ) ((void)0)
+#  define TRACE_END( _c, _s ) ((void)0)
+#endif
+
+
+#define SCRATCH_NAME "finally.scratch"
+#define POOL_NAME "finally.pool"
+
+
+/* fixed-size buffer for log messages */
+typedef struct {
+  size_t n;
+  int    truncated;
+  char   buf[ FINALLY_LOGSIZE ];
+} log_buffer;
+
+
+/* memory block of a bump allocator (the memory follows the header) */
+typedef struct arena_block {
+  struct arena_block* next;
+  size_t              size;
+  size_t              used;
+} arena_block;
+
+
+/* state of an active `finally` call (lives on the C stack) */
+typedef struct scope {
+  struct scope* prev;
+  size_t        id;
+  size_t        base; /* first bound resource */
+  lua_Alloc     alloc; /* for the arena blocks */
+  void*         ud;
+  arena_block*  arena;
+  lua_State*    L2; /* thread for the cleanup function */
+  void*         as; /* saved allocator in debug mode (or NULL) */
+  int           scratch; /* cleanup function gets a scratch table */
+  int           nogc;
+  int           observe;
+  int           results; /* max. number of results passed to cleanup */
+  int           nfixed; /* number of stack slots before the results */
+  int           done; /* cleanup function has run (or is running) */
+  int           drained; /* cleaned up and released by `finally.drain` */
+} scope;
+
+
+/* source position of memory allocations */
+typedef struct {
+  char   source[ LUA_IDSIZE ];
+  int    line;
+  size_t count;
+  size_t bytes;
+} alloc_site;
+
+
+/* state of the sampled observe mode: a counting allocator is used
+ * during some cleanup functions, and a line hook keeps track of the
+ * current source position */
+typedef struct {
+  lua_Alloc  alloc; /* original allocator */
+  void*      ud;
+  size_t     every; /* sample 1 in `every` calls (0 = off) */
+  size_t     calls;
+  alloc_site pos; /* current position */
+  size_t     nsites;
+  size_t     dropped; /* allocations not recorded (too many sites) */
+  alloc_site sites[ FINALLY_SITES ];
+} observer;
+
+
+/* state of the allocation profiler for main functions: allocations
+ * are attributed to the innermost active main function */
+typedef struct {
+  lua_Alloc   alloc; /* original allocator */
+  void*       ud;
+  int         enabled;
+  alloc_site* current; /* site of the innermost main function */
+  size_t      dropped; /* allocations not recorded (table full) */
+  alloc_site  sites[ FINALLY_SCOPES ]; /* hash table */
+} profiler;
+
+
+/* sampled stacks of cleanup functions (in collapsed format, i.e.
+ * frames separated by semicolons) */
+typedef struct {
+  char   stack[ FINALLY_STACKLEN ];
+  size_t count;
+} stack_sample;
+
+/* userdata for the sampling profiler for cleanup functions */
+typedef struct {
+  int          period; /* number of instructions between samples */
+  size_t       dropped; /* samples not recorded (table full) */
+  stack_sample stacks[ FINALLY_STACKS ]; /* hash table */
+} sampler;
+
+
+/* per Lua state data shared by all functions of this module */
+typedef struct {
+  scope*     current; /* innermost active `finally` call */
+  size_t     nscopes; /* to generate unique scope ids */
+  size_t     nresources; /* number of slots used by bound resources */
+  log_buffer log;
+  observer   obs;
+  profiler   prof;
+  sampler*   smp; /* created on demand */
+#if FINALLY_MMAP
+  struct locked_region* region; /* for reservations (or NULL) */
+#endif
+#if FINALLY_TRACE
+  trace_ring* trace; /* created on demand */
+#endif
+} module_state;
+
+
+/* userdata for scratch buffers */
+typedef struct {
+  char*  data;
+  size_t size;
+  size_t scope; /* id of the scope that owns the memory */
+} scratch_buffer;
+
+
+/* userdata for object pools; the uservalue holds the factory, the
+ * reset function, and the idle objects */
+typedef struct {
+  size_t capacity;
+  size_t count; /* number of idle objects */
+  size_t hits;
+  size_t misses;
+} object_pool;
+
+#define POOL_FIRST 3 /* index of first idle object in uservalue */
+
+
+/* userdata for nurseries; the uservalue holds the child coroutines */
+typedef struct {
+  size_t n;
+  int    closed;
+} nursery;
+
+
 /* struct to save Lua allocator */
 typedef struct {
   lua_Alloc alloc;
@@ -81,6 +758,200 @@ static void* alloc_fail( void* ud, void* ptr, size_t osize,
 }
 
 
+/* count memory allocations (and record them at the current source
+ * position) in observe mode */
+static void* alloc_count( void* ud, void* ptr, size_t osize,
+                          size_t nsize ) {
+  observer* o = ud;
+  if( nsize > 0 && (ptr == NULL || osize < nsize) ) {
+    size_t i = 0;
+    for( i = 0; i < o->nsites; i++ )
+      if( o->sites[ i ].line == o->pos.line &&
+          strcmp( o->sites[ i ].source, o->pos.source ) == 0 )
+        break;
+    if( i == o->nsites && i < FINALLY_SITES ) {
+      o->sites[ i ] = o->pos;
+      o->nsites++;
+    }
+    if( i < o->nsites ) {
+      o->sites[ i ].count++;
+      o->sites[ i ].bytes += ptr == NULL ? nsize : nsize-osize;
+    } else
+      o->dropped++;
+  }
+  return o->alloc( o->ud, ptr, osize, nsize );
+}
+
+
+/* line hook for the cleanup thread in observe mode; the observer is
+ * the userdata of the current allocator */
+static void observe_hook( lua_State* L, lua_Debug* ar ) {
+  void* ud = NULL;
+  if( lua_getallocf( L, &ud ) == alloc_count &&
+      lua_getinfo( L, "Sl", ar ) ) {
+    observer* o = ud;
+    size_t n = strlen( ar->short_src );
+    memcpy( o->pos.source, ar->short_src, n+1 );
+    o->pos.line = ar->currentline;
+  }
+}
+
+
+/* returns 1 if the counting allocator has been installed; for
+ * cleanups nested in an observed cleanup it is already in place */
+static int observe_begin( lua_State* L, observer* o ) {
+  if( lua_getallocf( L, NULL ) == alloc_count )
+    return 0;
+  o->alloc = lua_getallocf( L, &o->ud );
+  memcpy( o->pos.source, "?", 2 );
+  o->pos.line = 0;
+  o->pos.count = 0;
+  o->pos.bytes = 0;
+  lua_setallocf( L, alloc_count, o );
+  return 1;
+}
+
+
+static void observe_end( lua_State* L, observer* o, int installed ) {
+  if( installed )
+    lua_setallocf( L, o->alloc, o->ud );
+}
+
+
+static unsigned long fnv1a( unsigned long h, char const* s, size_t n ) {
+  size_t i = 0;
+  for( i = 0; i < n; i++ )
+    h = ((h ^ (unsigned char)s[ i ]) * 16777619u) & 0xffffffffu;
+  return h;
+}
+
+
+/* registry key for the sampler userdata */
+static char const sampler_key = 0;
+
+/* count hook for the cleanup thread: record the current call stack
+ * of the cleanup function in collapsed format without allocating
+ * memory */
+static void sample_hook( lua_State* L ) {
+  sampler* smp = NULL;
+  lua_Debug ar;
+  char buf[ FINALLY_STACKLEN ];
+  size_t n = 0, i = 0;
+  unsigned long h = 0;
+  int depth = 0, level = 0;
+  lua_pushlightuserdata( L, (void*)&sampler_key );
+  lua_rawget( L, LUA_REGISTRYINDEX );
+  smp = lua_touserdata( L, -1 );
+  lua_pop( L, 1 );
+  if( smp == NULL )
+    return;
+  while( lua_getstack( L, depth, &ar ) )
+    depth++;
+  for( level = depth-1; level >= 0; level-- ) { /* root first */
+    char frame[ LUA_IDSIZE+64 ];
+    size_t len = 0;
+    if( !lua_getstack( L, level, &ar ) || !lua_getinfo( L, "Sln", &ar ) )
+      continue;
+    /* skip the frames used for preallocation */
+    if( *ar.what == 'C' ? ar.name == NULL :
+        strcmp( ar.short_src, "(embedded)" ) == 0 )
+      continue;
+    sprintf( frame, "%s%.40s (%s:%d)", n > 0 ? ";" : "",
+             ar.name ? ar.name : "?", ar.short_src, ar.currentline );
+    len = strlen( frame );
+    if( n+len >= sizeof( buf ) ) {
+      smp->dropped++;
+      return;
+    }
+    memcpy( buf+n, frame, len+1 );
+    n += len;
+  }
+  if( n == 0 )
+    return;
+  h = fnv1a( 2166136261u, buf, n );
+  for( i = 0; i < FINALLY_STACKS; i++ ) {
+    stack_sample* st = smp->stacks + (h+i) % FINALLY_STACKS;
+    if( st->count == 0 )
+      memcpy( st->stack, buf, n+1 );
+    if( strcmp( st->stack, buf ) == 0 ) {
+      st->count++;
+      return;
+    }
+  }
+  smp->dropped++;
+}
+
+
+/* hook for cleanup threads (observe mode and/or sampling profiler) */
+static void cleanup_hook( lua_State* L, lua_Debug* ar ) {
+  if( ar->event == LUA_HOOKCOUNT )
+    sample_hook( L );
+  else
+    observe_hook( L, ar );
+}
+
+
+/* count memory allocations of main functions in profiling mode */
+static void* alloc_profile( void* ud, void* ptr, size_t osize,
+                            size_t nsize ) {
+  profiler* p = ud;
+  if( nsize > 0 && (ptr == NULL || osize < nsize) ) {
+    if( p->current ) {
+      p->current->count++;
+      p->current->bytes += ptr == NULL ? nsize : nsize-osize;
+    } else
+      p->dropped++;
+  }
+  return p->alloc( p->ud, ptr, osize, nsize );
+}
+
+
+/* find (or create) the hash table entry for a main function */
+static alloc_site* profile_site( profiler* p, char const* source,
+                                 int line ) {
+  size_t i = strlen( source ), n = 0;
+  unsigned long h = fnv1a( 2166136261u, source, i );
+  h = ((h ^ (unsigned)line) * 16777619u) & 0xffffffffu;
+  for( n = 0; n < FINALLY_SCOPES; n++ ) {
+    alloc_site* site = p->sites + (h+n) % FINALLY_SCOPES;
+    if( site->source[ 0 ] == '\0' ) {
+      memcpy( site->source, source, i+1 );
+      site->line = line;
+      return site;
+    } else if( site->line == line &&
+               strcmp( site->source, source ) == 0 )
+      return site;
+  }
+  return NULL;
+}
+
+
+/* attribute allocations to the main function at index `idx`;
+ * returns whether the profiling allocator had to be installed */
+static int profile_begin( lua_State* L, profiler* p, int idx,
+                          alloc_site** outer ) {
+  lua_Debug ar;
+  lua_pushvalue( L, idx );
+  lua_getinfo( L, ">S", &ar );
+  *outer = p->current;
+  p->current = profile_site( p, ar.short_src, ar.linedefined );
+  if( lua_getallocf( L, NULL ) != alloc_profile ) {
+    p->alloc = lua_getallocf( L, &p->ud );
+    lua_setallocf( L, alloc_profile, p );
+    return 1;
+  }
+  return 0;
+}
+
+
+static void profile_end( lua_State* L, profiler* p, alloc_site* outer,
+                         int installed ) {
+  p->current = outer;
+  if( installed )
+    lua_setallocf( L, p->alloc, p->ud );
+}
+
+
 #if LUA_VERSION_NUM > 501 /* Lua 5.2+ */
 
 /* preallocate stack frames, preallocate stack slots, change Lua
@@ -94,23 +965,27 @@ LUA_KFUNCTION( preallocatek ) {
       stack = lua_tointeger( L, 3 );
       if( stack )
         luaL_checkstack( L, (int)stack, "preallocate" );
-      if( calls > 0 ) {
-        lua_pushvalue( L, 1 );
-        lua_pushvalue( L, 1 );
-        lua_pushinteger( L, calls-1 );
-        lua_callk( L, 2, LUA_MULTRET, 1, preallocatek );
-    case 1:
-        if( lua_isfunction( L, 5 ) ) {
-          alloc_state* as = lua_touserdata( L, 4 );
-          if( as )
-            lua_setallocf( L, alloc_fail, as );
-          lua_call( L, lua_gettop( L )-5, 0 );
-          return 0;
-        }
-      } else
+      if( calls <= 0 )
         return lua_yield( L, 0 );
+      /* only the outermost call has the cleanup function */
+      ctx = lua_gettop( L ) > 2 ? 1 : 2;
+      lua_pushvalue( L, 1 );
+      lua_pushvalue( L, 1 );
+      lua_pushinteger( L, calls-1 );
+      lua_callk( L, 2, LUA_MULTRET, ctx, preallocatek );
+      if( ctx != 1 )
+        return lua_gettop( L )-2;
+      /* fall through */
+    case 1: { /* outermost call: run the cleanup function */
+      alloc_state* as = lua_touserdata( L, 4 );
+      if( as )
+        lua_setallocf( L, alloc_fail, as );
+      lua_call( L, lua_gettop( L )-5, 0 );
+      return 0;
+    }
   }
-  return lua_gettop( L ) > 2;
+  /* pass values from the resume down to the outermost call */
+  return lua_gettop( L )-2;
 }
 
 static int preallocate( lua_State* L ) {
@@ -170,31 +1045,1215 @@ static void push_lua_prealloc( lua_State* L ) {
 #endif
 
 
-static int lfinally( lua_State* L ) {
-  lua_Integer minstack = 0, mincalls = 0;
-  int debug = 0, status = 0, status2 = 0, nret = 0;
-  alloc_state as = { 0, 0 };
-  lua_State* L2 = NULL;
-  luaL_checktype( L, 1, LUA_TFUNCTION );
-  luaL_checktype( L, 2, LUA_TFUNCTION );
-  minstack = luaL_optinteger( L, 3, 100 );
-  luaL_argcheck( L, minstack > 0, 3,
-                 "invalid number of reserved stack slots" );
-  mincalls = luaL_optinteger( L, 4, 10 );
-  luaL_argcheck( L, mincalls > 0, 4,
-                 "invalid minimum number of call frames" );
-  debug = lua_toboolean( L, 5 );
-  lua_settop( L, 2 );
-  /* prepare thread to run the cleanup function */
-  L2 = lua_newthread( L );
-#if LUA_VERSION_NUM > 501
-  mincalls += 1; /* stack frame(s) used internally */
-  lua_pushcfunction( L2, preallocate );
-#else
-  /* Lua 5.1 doesn't support yieldable C functions, so we use a Lua
-   * closure to preallocate stack and call frames. This only allocates
-   * *Lua* call frames though, not C call frames, so you could hit a
-   * limit there while executing the cleanup function later!
+static void log_append( log_buffer* lb, char const* s, size_t len ) {
+  if( len > sizeof( lb->buf )-lb->n ) {
+    len = sizeof( lb->buf )-lb->n;
+    lb->truncated = 1;
+  }
+  memcpy( lb->buf+lb->n, s, len );
+  lb->n += len;
+}
+
+
+static void log_flush( log_buffer* lb ) {
+  if( lb->n > 0 || lb->truncated ) {
+    fwrite( lb->buf, 1, lb->n, stderr );
+    if( lb->truncated )
+      fputs( "[finally: log buffer truncated]\n", stderr );
+    fflush( stderr );
+    lb->n = 0;
+    lb->truncated = 0;
+  }
+}
+
+
+/* append the arguments to the log buffer without allocating any
+ * memory (i.e. numbers are formatted in a C buffer, and no implicit
+ * string conversions take place) */
+static int llog( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  int i = 1, n = lua_gettop( L );
+  for( i = 1; i <= n; i++ ) {
+    char tmp[ 64 ];
+    size_t len = 0;
+    char const* s = NULL;
+    switch( lua_type( L, i ) ) {
+      case LUA_TSTRING:
+        s = lua_tolstring( L, i, &len );
+        break;
+      case LUA_TNUMBER:
+#if LUA_VERSION_NUM > 502
+        if( lua_isinteger( L, i ) )
+          sprintf( tmp, LUA_INTEGER_FMT, (LUAI_UACINT)lua_tointeger( L, i ) );
+        else
+#endif
+        sprintf( tmp, "%.14g", (double)lua_tonumber( L, i ) );
+        s = tmp;
+        len = strlen( tmp );
+        break;
+      case LUA_TBOOLEAN:
+        s = lua_toboolean( L, i ) ? "true" : "false";
+        len = strlen( s );
+        break;
+      default:
+        s = luaL_typename( L, i );
+        len = strlen( s );
+        break;
+    }
+    log_append( &ms->log, s, len );
+  }
+  return 0;
+}
+
+
+/* `finally.observe( n )` samples 1 in `n` calls for allocations in
+ * the cleanup function (`n` = 0 or `nil` turns it off) */
+static int lobserve( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  lua_Integer n = luaL_optinteger( L, 1, 0 );
+  luaL_argcheck( L, n >= 0, 1, "invalid sampling interval" );
+  ms->obs.every = (size_t)n;
+  ms->obs.calls = 0;
+  return 0;
+}
+
+
+static void push_site( lua_State* L, alloc_site const* site ) {
+  lua_createtable( L, 0, 4 );
+  lua_pushstring( L, site->source );
+  lua_setfield( L, -2, "source" );
+  lua_pushinteger( L, site->line );
+  lua_setfield( L, -2, "line" );
+  lua_pushinteger( L, (lua_Integer)site->count );
+  lua_setfield( L, -2, "count" );
+  lua_pushinteger( L, (lua_Integer)site->bytes );
+  lua_setfield( L, -2, "bytes" );
+}
+
+
+/* `finally.profile( on )` turns the allocation profiler for main
+ * functions on (resetting the collected data) or off */
+static int lprofile( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  ms->prof.enabled = lua_toboolean( L, 1 );
+  if( ms->prof.enabled ) {
+    memset( ms->prof.sites, 0, sizeof( ms->prof.sites ) );
+    ms->prof.current = NULL;
+    ms->prof.dropped = 0;
+  }
+  return 0;
+}
+
+
+/* `finally.hotspots( [n] )` returns the `n` (default 10) main
+ * functions that allocated the most memory, and the number of
+ * allocations that couldn't be attributed */
+static int lhotspots( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  lua_Integer n = luaL_optinteger( L, 1, 10 );
+  alloc_site* top[ FINALLY_SCOPES ];
+  size_t i = 0, j = 0, k = 0;
+  for( i = 0; i < FINALLY_SCOPES; i++ ) { /* insertion sort */
+    alloc_site* site = ms->prof.sites+i;
+    if( site->source[ 0 ] != '\0' ) {
+      for( j = k; j > 0 && top[ j-1 ]->bytes < site->bytes; j-- )
+        top[ j ] = top[ j-1 ];
+      top[ j ] = site;
+      k++;
+    }
+  }
+  if( n >= 0 && (size_t)n < k )
+    k = (size_t)n;
+  lua_createtable( L, (int)k, 0 );
+  for( i = 0; i < k; i++ ) {
+    push_site( L, top[ i ] );
+    lua_rawseti( L, -2, (int)i+1 );
+  }
+  lua_pushinteger( L, (lua_Integer)ms->prof.dropped );
+  return 2;
+}
+
+
+/* `finally.sample( period )` samples the call stacks of cleanup
+ * functions every `period` VM instructions (0 or `nil` turns the
+ * sampling off, but keeps the data) */
+static int lsample( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  lua_Integer period = luaL_optinteger( L, 1, 0 );
+  luaL_argcheck( L, period >= 0 && period <= 0x7fffffff, 1,
+                 "invalid sampling period" );
+  if( period > 0 ) {
+    if( ms->smp == NULL ) {
+      lua_pushlightuserdata( L, (void*)&sampler_key );
+      ms->smp = lua_newuserdata( L, sizeof( sampler ) );
+      lua_rawset( L, LUA_REGISTRYINDEX );
+    }
+    memset( ms->smp, 0, sizeof( sampler ) );
+  }
+  if( ms->smp != NULL )
+    ms->smp->period = (int)period;
+  return 0;
+}
+
+
+/* `finally.stacks()` returns the sampled stacks in the collapsed
+ * format used by flame graph tools (one stack and its sample count
+ * per line), and the number of samples that couldn't be recorded */
+static int lstacks( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  luaL_Buffer b;
+  size_t i = 0;
+  luaL_buffinit( L, &b );
+  for( i = 0; ms->smp != NULL && i < FINALLY_STACKS; i++ ) {
+    stack_sample* st = ms->smp->stacks+i;
+    if( st->count > 0 ) {
+      char tmp[ 32 ];
+      sprintf( tmp, " %lu\n", (unsigned long)st->count );
+      luaL_addstring( &b, st->stack );
+      luaL_addstring( &b, tmp );
+    }
+  }
+  luaL_pushresult( &b );
+  lua_pushinteger( L, ms->smp ? (lua_Integer)ms->smp->dropped : 0 );
+  return 2;
+}
+
+
+#if FINALLY_TRACE
+/* `finally.trace( path [, n] )` records the last `n` (default 1024)
+ * `finally` calls in a ring buffer in the memory-mapped file `path`
+ * (`finally.trace( false )` stops tracing) */
+static int ltrace( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  char const* path = lua_toboolean( L, 1 ) ? luaL_checkstring( L, 1 )
+                                           : NULL;
+  lua_Integer n = luaL_optinteger( L, 2, 1024 );
+  trace_header* hdr = NULL;
+  size_t size = 0, nrecords = (size_t)n;
+  /* (`size_t` may be narrower than `lua_Integer`) */
+  luaL_argcheck( L, n > 0 && (lua_Integer)nrecords == n &&
+                 nrecords < ((size_t)-1-sizeof( *hdr )) /
+                            sizeof( trace_record ), 2,
+                 "invalid number of records" );
+  size = sizeof( *hdr ) + nrecords * sizeof( trace_record );
+  if( ms->trace == NULL ) {
+    lua_pushlightuserdata( L, (void*)&ms->trace );
+    ms->trace = lua_newuserdata( L, sizeof( trace_ring ) );
+    ms->trace->hdr = NULL;
+    ms->trace->size = 0;
+    ms->trace->gen = 0;
+    luaL_newmetatable( L, TRACE_NAME );
+    lua_pushcfunction( L, trace_gc );
+    lua_setfield( L, -2, "__gc" );
+    lua_setmetatable( L, -2 );
+    lua_rawset( L, LUA_REGISTRYINDEX );
+  }
+  trace_unmap( ms->trace );
+  if( path == NULL )
+    return 0;
+  hdr = map_file( path, size );
+  if( hdr == NULL ) {
+    lua_pushnil( L );
+    lua_pushfstring( L, "%s: %s", path, strerror( errno ) );
+    return 2;
+  }
+  memset( (void*)hdr, 0, size );
+  memcpy( hdr->h.magic, "FINTRACE", 8 );
+  hdr->h.version = TRACE_VERSION;
+  hdr->h.recordsize = sizeof( trace_record );
+  hdr->h.nrecords = (trace_u64)nrecords;
+  hdr->h.pid = (trace_u64)getpid();
+  ms->trace->hdr = hdr;
+  ms->trace->size = size;
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+#endif
+
+
+/* `finally.violations()` returns the recorded allocation sites in
+ * observe mode, and the number of allocations that couldn't be
+ * recorded */
+static int lviolations( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  size_t i = 0;
+  lua_createtable( L, (int)ms->obs.nsites, 0 );
+  for( i = 0; i < ms->obs.nsites; i++ ) {
+    push_site( L, ms->obs.sites+i );
+    lua_rawseti( L, -2, (int)i+1 );
+  }
+  lua_pushinteger( L, (lua_Integer)ms->obs.dropped );
+  return 2;
+}
+
+
+/* Resources bound to a scope are kept in a table in the registry
+ * (keyed by the module state) that is used as a stack: each resource
+ * takes three slots, a light userdata pointing to the release
+ * function, and two arguments for it. */
+static void push_resources( lua_State* L, module_state* ms ) {
+  lua_pushlightuserdata( L, (void*)ms );
+  lua_rawget( L, LUA_REGISTRYINDEX );
+}
+
+
+/* raise an error unless there is an innermost active scope that can
+ * take new resources */
+static scope* check_scope( lua_State* L, module_state* ms ) {
+  if( ms->current == NULL )
+    luaL_error( L, "no active 'finally' call" );
+  if( ms->current->drained )
+    luaL_error( L, "'finally' call has been drained" );
+  return ms->current;
+}
+
+
+/* bind the two values on top of the stack to the innermost active
+ * scope, so that `release` is called with them when the scope ends */
+static void scope_bind( lua_State* L, module_state* ms,
+                        lua_CFunction const* release ) {
+  check_scope( L, ms );
+  push_resources( L, ms );
+  lua_insert( L, -3 );
+  lua_rawseti( L, -3, (int)ms->nresources+3 );
+  lua_rawseti( L, -2, (int)ms->nresources+2 );
+  lua_pushlightuserdata( L, (void*)release );
+  lua_rawseti( L, -2, (int)ms->nresources+1 );
+  ms->nresources += 3;
+  lua_pop( L, 1 );
+}
+
+
+/* link the scope into the scope chain; scopes live on the C stack, so
+ * no error may escape before `scope_leave` unlinks it again */
+static void scope_enter( module_state* ms, scope* s ) {
+  s->prev = ms->current;
+  s->id = ++ms->nscopes;
+  s->base = ms->nresources;
+  s->alloc = 0;
+  s->ud = NULL;
+  s->arena = NULL;
+  s->L2 = NULL;
+  s->as = NULL;
+  s->scratch = 0;
+  s->nogc = 0;
+  s->observe = 0;
+  s->results = 0;
+  s->nfixed = 0;
+  s->done = 0;
+  s->drained = 0;
+  ms->current = s;
+}
+
+
+/* release all resources bound above `base` (in reverse order); the
+ * release functions get `drained` as third argument. If a release
+ * function raises an error, the first error is left on the stack and
+ * its status is returned */
+static int release_resources( lua_State* L, module_state* ms,
+                              size_t base, int drained ) {
+  int status = 0;
+  if( ms->nresources > base ) {
+    luaL_checkstack( L, 7, "release" );
+    push_resources( L, ms );
+    while( ms->nresources > base ) {
+      int i = (int)ms->nresources, j = 0, st = 0;
+      lua_CFunction const* release = NULL;
+      lua_rawgeti( L, -1, i-2 );
+      release = lua_touserdata( L, -1 );
+      lua_pop( L, 1 );
+      lua_pushcfunction( L, *release );
+      lua_rawgeti( L, -2, i-1 );
+      lua_rawgeti( L, -3, i );
+      for( j = i-2; j <= i; j++ ) {
+        lua_pushnil( L );
+        lua_rawseti( L, -5, j );
+      }
+      ms->nresources -= 3;
+      lua_pushboolean( L, drained );
+      st = lua_pcall( L, 3, 0, 0 );
+      if( st != 0 ) {
+        if( status == 0 ) {
+          status = st;
+          lua_insert( L, -2 ); /* keep error below resources */
+        } else
+          lua_pop( L, 1 );
+      }
+    }
+    lua_pop( L, 1 );
+  }
+  return status;
+}
+
+
+static void arena_free( scope* s ) {
+  arena_block* b = s->arena;
+  while( b != NULL ) {
+    arena_block* next = b->next;
+    s->alloc( s->ud, b, sizeof( arena_block )+b->size, 0 );
+    b = next;
+  }
+  s->arena = NULL;
+}
+
+
+/* free the scratch memory of the scope and release everything that
+ * is bound to it (unless `finally.drain` has done that already) */
+static int scope_leave( lua_State* L, module_state* ms, scope* s ) {
+  ms->current = s->prev;
+  arena_free( s );
+  return release_resources( L, ms, s->base, 0 );
+}
+
+
+static char* arena_alloc( lua_State* L, scope* s, size_t n ) {
+  arena_block* b = s->arena;
+  char* p = NULL;
+  if( n > (size_t)-1-sizeof( arena_block )-7 )
+    luaL_error( L, "scratch buffer too large" );
+  n = (n + 7) & ~(size_t)7; /* keep blocks aligned */
+  if( b == NULL || b->size-b->used < n ) {
+    size_t size = n > FINALLY_ARENASIZE ? n : FINALLY_ARENASIZE;
+    if( s->alloc == 0 )
+      s->alloc = lua_getallocf( L, &s->ud );
+    b = s->alloc( s->ud, NULL, 0, sizeof( arena_block )+size );
+    if( b == NULL )
+      luaL_error( L, "not enough memory for scratch buffer" );
+    b->next = s->arena;
+    b->size = size;
+    b->used = 0;
+    s->arena = b;
+  }
+  p = (char*)(b+1) + b->used;
+  b->used += n;
+  return p;
+}
+
+
+/* allocate a scratch buffer that is released when the innermost
+ * active `finally` call returns */
+static int lscratch( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  size_t size = (size_t)n;
+  scratch_buffer* sb = NULL;
+  /* (`size_t` may be narrower than `lua_Integer`) */
+  luaL_argcheck( L, n >= 0 && (lua_Integer)size == n, 1,
+                 "invalid buffer size" );
+  check_scope( L, ms );
+  sb = lua_newuserdata( L, sizeof( scratch_buffer ) );
+  sb->data = NULL;
+  sb->size = 0;
+  sb->scope = ms->current->id;
+  luaL_getmetatable( L, SCRATCH_NAME );
+  lua_setmetatable( L, -2 );
+  sb->data = arena_alloc( L, ms->current, size );
+  sb->size = size;
+  memset( sb->data, 0, sb->size );
+  return 1;
+}
+
+
+static scratch_buffer* check_scratch( lua_State* L, int idx ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  scratch_buffer* sb = luaL_checkudata( L, idx, SCRATCH_NAME );
+  scope* s = ms->current;
+  /* scope ids increase with nesting depth */
+  while( s != NULL && s->id > sb->scope )
+    s = s->prev;
+  if( s == NULL || s->id != sb->scope || s->drained ) {
+    sb->data = NULL;
+    sb->size = 0;
+    luaL_error( L, "scratch buffer used after its 'finally' call" );
+  }
+  return sb;
+}
+
+
+/* convert relative string position (negative means from end) */
+static size_t posrelat( lua_Integer pos, size_t len ) {
+  if( pos >= 0 )
+    return (size_t)pos;
+  else if( (size_t)0-(size_t)pos > len )
+    return 0;
+  else
+    return len + (size_t)pos + 1;
+}
+
+
+static int scratch_size( lua_State* L ) {
+  scratch_buffer* sb = check_scratch( L, 1 );
+  lua_pushinteger( L, (lua_Integer)sb->size );
+  return 1;
+}
+
+
+/* `:byte( [i [, j]] )` for buffers and memory maps */
+static int push_bytes( lua_State* L, char const* data, size_t size ) {
+  size_t i = posrelat( luaL_optinteger( L, 2, 1 ), size );
+  size_t j = posrelat( luaL_optinteger( L, 3, (lua_Integer)i ), size );
+  int n = 0;
+  if( i < 1 )
+    i = 1;
+  if( j > size )
+    j = size;
+  if( i > j )
+    return 0;
+  luaL_checkstack( L, (int)(j-i+1), "buffer slice too long" );
+  for( ; i <= j; i++, n++ )
+    lua_pushinteger( L, (unsigned char)data[ i-1 ] );
+  return n;
+}
+
+
+/* `:sub( [i [, j]] )` for buffers and memory maps */
+static int push_sub( lua_State* L, char const* data, size_t size ) {
+  size_t i = posrelat( luaL_optinteger( L, 2, 1 ), size );
+  size_t j = posrelat( luaL_optinteger( L, 3, -1 ), size );
+  if( i < 1 )
+    i = 1;
+  if( j > size )
+    j = size;
+  if( i > j )
+    lua_pushliteral( L, "" );
+  else
+    lua_pushlstring( L, data+i-1, j-i+1 );
+  return 1;
+}
+
+
+static int scratch_byte( lua_State* L ) {
+  scratch_buffer* sb = check_scratch( L, 1 );
+  return push_bytes( L, sb->data, sb->size );
+}
+
+
+static int scratch_sub( lua_State* L ) {
+  scratch_buffer* sb = check_scratch( L, 1 );
+  return push_sub( L, sb->data, sb->size );
+}
+
+
+static int scratch_set( lua_State* L ) {
+  scratch_buffer* sb = check_scratch( L, 1 );
+  size_t i = posrelat( luaL_checkinteger( L, 2 ), sb->size );
+  size_t len = 0;
+  char const* s = luaL_checklstring( L, 3, &len );
+  luaL_argcheck( L, i >= 1 && len <= sb->size && i-1 <= sb->size-len, 2,
+                 "out of bounds" );
+  memcpy( sb->data+i-1, s, len );
+  return 0;
+}
+
+
+static int pool_release( lua_State* L ) {
+  object_pool* p = lua_touserdata( L, 1 );
+  if( lua_toboolean( L, 3 ) ) /* drained: object may still be in use */
+    return 0;
+  lua_settop( L, 2 );
+  lua_getuservalue( L, 1 );
+  lua_rawgeti( L, 3, 2 ); /* reset function */
+  if( !lua_isnil( L, 2 ) && lua_isfunction( L, 4 ) ) {
+    lua_pushvalue( L, 2 );
+    lua_call( L, 1, 0 ); /* on error the object is dropped */
+  }
+  if( !lua_isnil( L, 2 ) && p->count < p->capacity ) {
+    lua_pushvalue( L, 2 );
+    lua_rawseti( L, 3, (int)(POOL_FIRST+p->count) );
+    p->count++;
+  }
+  return 0;
+}
+
+static lua_CFunction const release_pool = pool_release;
+
+
+/* create an object pool */
+static int lpool( lua_State* L ) {
+  lua_Integer capacity = luaL_optinteger( L, 3, 16 );
+  object_pool* p = NULL;
+  luaL_checktype( L, 1, LUA_TFUNCTION );
+  if( !lua_isnoneornil( L, 2 ) )
+    luaL_checktype( L, 2, LUA_TFUNCTION );
+  luaL_argcheck( L, capacity > 0 && capacity <= INT_MAX-POOL_FIRST, 3,
+                 "invalid pool capacity" );
+  lua_settop( L, 2 );
+  p = lua_newuserdata( L, sizeof( object_pool ) );
+  p->capacity = (size_t)capacity;
+  p->count = 0;
+  p->hits = 0;
+  p->misses = 0;
+  luaL_getmetatable( L, POOL_NAME );
+  lua_setmetatable( L, -2 );
+  lua_createtable( L, (int)capacity+POOL_FIRST-1, 0 );
+  lua_pushvalue( L, 1 );
+  lua_rawseti( L, -2, 1 );
+  lua_pushvalue( L, 2 );
+  lua_rawseti( L, -2, 2 );
+  lua_setuservalue( L, -2 );
+  return 1;
+}
+
+
+/* take an object from the pool (or create a new one) and bind it to
+ * the innermost active scope */
+static int pool_acquire( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  object_pool* p = luaL_checkudata( L, 1, POOL_NAME );
+  check_scope( L, ms );
+  lua_settop( L, 1 );
+  lua_getuservalue( L, 1 );
+  if( p->count > 0 ) {
+    p->count--;
+    lua_rawgeti( L, 2, (int)(POOL_FIRST+p->count) );
+    lua_pushnil( L );
+    lua_rawseti( L, 2, (int)(POOL_FIRST+p->count) );
+    p->hits++;
+  } else {
+    lua_rawgeti( L, 2, 1 );
+    lua_call( L, 0, 1 );
+    p->misses++;
+  }
+  lua_pushvalue( L, 1 );
+  lua_pushvalue( L, 3 );
+  scope_bind( L, ms, &release_pool );
+  return 1;
+}
+
+
+static int pool_stats( lua_State* L ) {
+  object_pool* p = luaL_checkudata( L, 1, POOL_NAME );
+  lua_pushinteger( L, (lua_Integer)p->hits );
+  lua_pushinteger( L, (lua_Integer)p->misses );
+  lua_pushinteger( L, (lua_Integer)p->count );
+  return 3;
+}
+
+
+/* Files opened via `finally.open` are standard file handles of the
+ * io library that are bound to the innermost active scope and closed
+ * from C when it ends. In Lua 5.2+ they are created here as
+ * `luaL_Stream`s; the file handles of Lua 5.1 and LuaJIT differ, so
+ * there they come from `io.open` and are closed via `io.close`. */
+#if LUA_VERSION_NUM == 501
+
+/* push `io[ name ]` */
+static void push_io( lua_State* L, char const* name ) {
+  lua_getfield( L, LUA_REGISTRYINDEX, "_LOADED" );
+  lua_getfield( L, -1, "io" );
+  if( !lua_istable( L, -1 ) )
+    luaL_error( L, "io library not loaded" );
+  lua_getfield( L, -1, name );
+  lua_replace( L, -3 );
+  lua_pop( L, 1 );
+}
+
+
+static int file_release( lua_State* L ) {
+  lua_settop( L, 1 );
+  push_io( L, "type" );
+  lua_pushvalue( L, 1 );
+  lua_call( L, 1, 1 );
+  if( lua_isstring( L, -1 ) &&
+      strcmp( lua_tostring( L, -1 ), "file" ) == 0 ) { /* still open */
+    push_io( L, "close" );
+    lua_pushvalue( L, 1 );
+    lua_call( L, 1, 2 );
+    if( lua_isnil( L, -2 ) )
+      return luaL_error( L, "error closing file: %s",
+                         lua_tostring( L, -1 ) );
+  }
+  return 0;
+}
+
+#else
+
+static int file_close( lua_State* L ) {
+  luaL_Stream* p = luaL_checkudata( L, 1, LUA_FILEHANDLE );
+  int res = fclose( p->f );
+  return luaL_fileresult( L, res == 0, NULL );
+}
+
+
+static int file_release( lua_State* L ) {
+  int res = 0;
+  luaL_Stream* p = lua_touserdata( L, 1 );
+  if( p->closef != NULL ) { /* not closed yet */
+    p->closef = NULL; /* mark as closed */
+    res = fclose( p->f );
+  }
+  if( res != 0 )
+    return luaL_error( L, "error closing file: %s", strerror( errno ) );
+  return 0;
+}
+
+#endif
+
+static lua_CFunction const release_file = file_release;
+
+
+static int check_mode( char const* mode ) {
+  return *mode != '\0' && strchr( "rwa", *(mode++) ) != NULL &&
+         (*mode != '+' || (++mode, 1)) &&
+         strspn( mode, "b" ) == strlen( mode );
+}
+
+
+/* `finally.open( path [, mode] )` works like `io.open`, but the file
+ * is closed when the innermost active `finally` call returns */
+static int lopen( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  char const* path = luaL_checkstring( L, 1 );
+  char const* mode = luaL_optstring( L, 2, "r" );
+#if LUA_VERSION_NUM == 501
+  luaL_argcheck( L, check_mode( mode ), 2, "invalid mode" );
+  check_scope( L, ms );
+  push_io( L, "open" );
+  lua_pushstring( L, path );
+  lua_pushstring( L, mode );
+  lua_call( L, 2, 3 );
+  if( lua_isnil( L, -3 ) )
+    return 3;
+  lua_pop( L, 2 );
+#else
+  FILE* f = NULL;
+  luaL_Stream* p = NULL;
+  luaL_argcheck( L, check_mode( mode ), 2, "invalid mode" );
+  check_scope( L, ms );
+  lua_settop( L, 2 );
+  p = lua_newuserdata( L, sizeof( luaL_Stream ) );
+  p->f = NULL;
+  p->closef = NULL; /* closed until opened */
+  luaL_getmetatable( L, LUA_FILEHANDLE );
+  if( !lua_istable( L, -1 ) )
+    return luaL_error( L, "io library not loaded" );
+  lua_setmetatable( L, -2 );
+  f = fopen( path, mode );
+  if( f == NULL )
+    return luaL_fileresult( L, 0, path );
+  p->f = f;
+  p->closef = file_close;
+#endif
+  lua_pushvalue( L, -1 );
+  lua_pushnil( L );
+  scope_bind( L, ms, &release_file );
+  return 1;
+}
+
+
+#if FINALLY_MMAP
+
+#define MMAP_NAME "finally.mmap"
+
+/* userdata for read-only views of memory-mapped files */
+typedef struct {
+  char const* data; /* NULL after the view has been released */
+  size_t      size;
+  void*       base; /* start of the (page aligned) mapping */
+  size_t      len; /* length of the mapping */
+} mmap_view;
+
+
+static int mmap_release( lua_State* L ) {
+  mmap_view* v = lua_touserdata( L, 1 );
+  if( v->base != NULL )
+    munmap( v->base, v->len );
+  v->data = NULL;
+  v->size = 0;
+  v->base = NULL;
+  v->len = 0;
+  return 0;
+}
+
+static lua_CFunction const release_mmap = mmap_release;
+
+
+static mmap_view* check_view( lua_State* L, int idx ) {
+  mmap_view* v = luaL_checkudata( L, idx, MMAP_NAME );
+  if( v->data == NULL )
+    luaL_error( L, "memory map used after its 'finally' call" );
+  return v;
+}
+
+
+static int mmap_size( lua_State* L ) {
+  mmap_view* v = check_view( L, 1 );
+  lua_pushinteger( L, (lua_Integer)v->size );
+  return 1;
+}
+
+
+static int mmap_byte( lua_State* L ) {
+  mmap_view* v = check_view( L, 1 );
+  return push_bytes( L, v->data, v->size );
+}
+
+
+static int mmap_sub( lua_State* L ) {
+  mmap_view* v = check_view( L, 1 );
+  return push_sub( L, v->data, v->size );
+}
+
+
+/* `finally.mmap( path [, offset [, length]] )` maps (a part of) a file
+ * read-only into memory until the innermost active `finally` call
+ * returns */
+static int lmmap( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  char const* path = luaL_checkstring( L, 1 );
+  lua_Integer offset = luaL_optinteger( L, 2, 0 );
+  lua_Integer length = luaL_optinteger( L, 3, -1 );
+  mmap_view* v = NULL;
+  struct stat st;
+  size_t skew = 0;
+  void* p = MAP_FAILED;
+  int fd = -1;
+  luaL_argcheck( L, offset >= 0, 2, "invalid offset" );
+  luaL_argcheck( L, length >= -1, 3, "invalid length" );
+  check_scope( L, ms );
+  lua_settop( L, 3 );
+  v = lua_newuserdata( L, sizeof( mmap_view ) );
+  v->data = NULL;
+  v->size = 0;
+  v->base = NULL;
+  v->len = 0;
+  luaL_getmetatable( L, MMAP_NAME );
+  lua_setmetatable( L, -2 );
+  fd = open( path, O_RDONLY );
+  if( fd < 0 )
+    return luaL_fileresult( L, 0, path );
+  if( fstat( fd, &st ) != 0 ) {
+    int e = errno;
+    close( fd );
+    errno = e;
+    return luaL_fileresult( L, 0, path );
+  }
+  /* clip the view to the end of the file */
+  if( offset > (lua_Integer)st.st_size )
+    offset = (lua_Integer)st.st_size;
+  if( length < 0 || length > (lua_Integer)st.st_size-offset )
+    length = (lua_Integer)st.st_size-offset;
+  if( length > 0 ) { /* mapping must start at a page boundary */
+    skew = (size_t)(offset % sysconf( _SC_PAGESIZE ));
+    p = mmap( NULL, (size_t)length+skew, PROT_READ, MAP_PRIVATE, fd,
+              (off_t)offset-(off_t)skew );
+    if( p == MAP_FAILED ) {
+      int e = errno;
+      close( fd );
+      errno = e;
+      return luaL_fileresult( L, 0, path );
+    }
+    v->base = p;
+    v->len = (size_t)length+skew;
+    v->data = (char const*)p+skew;
+  } else
+    v->data = "";
+  v->size = (size_t)length;
+  close( fd );
+  lua_pushvalue( L, -1 );
+  lua_pushnil( L );
+  scope_bind( L, ms, &release_mmap );
+  return 1;
+}
+
+/* The memory for the reservations of cleanup functions can come from
+ * a separate memory region that is prefaulted and optionally locked
+ * into RAM. Lua allocators work per Lua state, so the allocator of
+ * the state is replaced by a routing allocator that places all
+ * allocations during the preallocation phase (stack slots and call
+ * frames of the cleanup thread) into the region, and keeps blocks
+ * of the region in the region when they are reallocated. The region
+ * is a list of chunks that is searched first fit (it only serves the
+ * reservations, so it is small). It can't be unmapped because blocks
+ * may be freed until the very end of `lua_close`. */
+typedef struct locked_region {
+  lua_Alloc alloc; /* original allocator */
+  void*     ud;
+  char*     base; /* first chunk */
+  size_t    size; /* of all chunks */
+  int       routing; /* new blocks go into the region */
+} locked_region;
+
+/* header of a chunk of the region (keeps blocks 16-byte aligned) */
+typedef union {
+  struct {
+    size_t size; /* including the header */
+    int    used;
+  } c;
+  char pad[ 16 ];
+} region_chunk;
+
+
+static int region_has( locked_region* r, void* ptr ) {
+  return (char*)ptr >= r->base && (char*)ptr < r->base+r->size;
+}
+
+
+static void* region_get( locked_region* r, size_t nsize ) {
+  char* p = r->base;
+  size_t n = 0;
+  if( nsize > r->size )
+    return NULL;
+  n = sizeof( region_chunk ) + ((nsize+15) & ~(size_t)15);
+  while( p < r->base+r->size ) {
+    region_chunk* c = (region_chunk*)p;
+    if( !c->c.used ) { /* merge with the following free chunks */
+      region_chunk* next = (region_chunk*)(p+c->c.size);
+      while( (char*)next < r->base+r->size && !next->c.used ) {
+        c->c.size += next->c.size;
+        next = (region_chunk*)(p+c->c.size);
+      }
+      if( c->c.size >= n ) {
+        if( c->c.size-n >= 2*sizeof( region_chunk ) ) { /* split */
+          next = (region_chunk*)(p+n);
+          next->c.size = c->c.size-n;
+          next->c.used = 0;
+          c->c.size = n;
+        }
+        c->c.used = 1;
+        return c+1;
+      }
+    }
+    p += c->c.size;
+  }
+  return NULL;
+}
+
+
+static void* region_alloc( void* ud, void* ptr, size_t osize,
+                           size_t nsize ) {
+  locked_region* r = ud;
+  void* p = NULL;
+  if( ptr != NULL && region_has( r, ptr ) ) {
+    region_chunk* c = (region_chunk*)ptr-1;
+    if( nsize == 0 ) {
+      c->c.used = 0;
+      return NULL;
+    } else if( nsize <= c->c.size-sizeof( region_chunk ) )
+      return ptr;
+    p = region_get( r, nsize );
+    if( p == NULL ) /* region is full */
+      p = r->alloc( r->ud, NULL, 0, nsize );
+    if( p != NULL ) {
+      memcpy( p, ptr, osize );
+      c->c.used = 0;
+    }
+    return p;
+  }
+  if( r->routing && nsize > 0 && (ptr == NULL || osize < nsize) ) {
+    p = region_get( r, nsize );
+    if( p != NULL ) {
+      if( ptr != NULL ) { /* move it into the region */
+        memcpy( p, ptr, osize );
+        r->alloc( r->ud, ptr, osize, 0 );
+      }
+      return p;
+    }
+  }
+  return r->alloc( r->ud, ptr, osize, nsize );
+}
+
+
+/* `finally.prefault( nbytes [, lock] )` maps a prefaulted memory
+ * region of (at least) `nbytes` bytes for the reservations of all
+ * following `finally` calls, and locks it into RAM if `lock` is
+ * true */
+static int lprefault( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  lua_Integer n = luaL_checkinteger( L, 1 );
+  int lock = lua_toboolean( L, 2 );
+  size_t page = (size_t)sysconf( _SC_PAGESIZE ), size = 0, hdr = 0;
+  locked_region* r = NULL;
+  region_chunk* c = NULL;
+  void* p = MAP_FAILED;
+  int fd = -1;
+  luaL_argcheck( L, n > 0 && n <= INT_MAX, 1, "invalid region size" );
+  if( ms->region != NULL )
+    return luaL_error( L, "memory region already set up" );
+  /* other allocators may be installed temporarily */
+  if( ms->current != NULL )
+    return luaL_error( L, "can't set up a memory region inside a "
+                          "'finally' call" );
+  hdr = (sizeof( locked_region )+15) & ~(size_t)15;
+  size = (hdr+(size_t)n+page-1) / page * page;
+  fd = open( "/dev/zero", O_RDWR );
+  if( fd >= 0 ) {
+    p = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+    close( fd );
+  }
+  if( p == MAP_FAILED )
+    return luaL_fileresult( L, 0, "/dev/zero" );
+  memset( p, 0, size ); /* touch every page */
+  if( lock && mlock( p, size ) != 0 ) {
+    int e = errno;
+    munmap( p, size );
+    errno = e;
+    return luaL_fileresult( L, 0, "mlock" );
+  }
+  r = p;
+  r->alloc = lua_getallocf( L, &r->ud );
+  r->base = (char*)p+hdr;
+  r->size = size-hdr;
+  r->routing = 0;
+  c = (region_chunk*)r->base;
+  c->c.size = r->size;
+  c->c.used = 0;
+  lua_setallocf( L, region_alloc, r );
+  ms->region = r;
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+#endif /* FINALLY_MMAP */
+
+
+/* `spawn( f )` creates a child coroutine of a nursery */
+static int nursery_spawn( lua_State* L ) {
+  nursery* ns = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  lua_State* co = NULL;
+  luaL_checktype( L, 1, LUA_TFUNCTION );
+  if( ns->closed )
+    luaL_error( L, "nursery is closed" );
+  if( ns->n >= INT_MAX )
+    luaL_error( L, "too many children" );
+  lua_getuservalue( L, lua_upvalueindex( 1 ) );
+  co = lua_newthread( L );
+  lua_pushvalue( L, 1 );
+  lua_xmove( L, co, 1 );
+  lua_pushvalue( L, -1 );
+  lua_rawseti( L, -3, (int)++ns->n );
+  return 1;
+}
+
+
+/* main function of a nursery: call the body with `spawn` */
+static int nursery_main( lua_State* L ) {
+  lua_pushvalue( L, lua_upvalueindex( 1 ) );
+  lua_pushvalue( L, lua_upvalueindex( 2 ) );
+  lua_call( L, 1, LUA_MULTRET );
+  return lua_gettop( L );
+}
+
+
+/* count hook that raises an error (once per resume) at the next
+ * instruction of a cancelled coroutine */
+static void cancel_hook( lua_State* L, lua_Debug* ar ) {
+  (void)ar;
+  lua_sethook( L, (lua_Hook)0, 0, 0 );
+  lua_pushliteral( L, "closed" );
+  lua_error( L );
+}
+
+
+/* max. number of times a cancelled coroutine is resumed again because
+ * it has caught the error and yielded once more */
+#define CANCEL_ROUNDS 16
+
+/* cancel a suspended coroutine by resuming it with an error, so that
+ * the cleanup code of its pending protected calls runs; if it catches
+ * the error and yields again, it is resumed with the error again
+ * until it is dead. On Lua 5.4 its pending to-be-closed variables are
+ * closed via `lua_closethread` (also for coroutines that have died
+ * with an error before). Returns non-zero (with the error on top of
+ * `L`) if the cleanup code raised an error of its own, or if the
+ * coroutine refuses to die */
+static int cancel_thread( lua_State* co, lua_State* L ) {
+  int status = lua_status( co ), nret = 0, rounds = 0;
+  if( status == LUA_YIELD ) {
+    do {
+#if LUA_VERSION_NUM >= 504
+      lua_pop( co, nret ); /* values from the last yield */
+#else
+      lua_settop( co, 0 );
+#endif
+      lua_sethook( co, cancel_hook, LUA_MASKCOUNT, 1 );
+      status = lua_resume( co, L, 0, &nret );
+      lua_sethook( co, (lua_Hook)0, 0, 0 );
+    } while( status == LUA_YIELD && ++rounds < CANCEL_ROUNDS );
+  } else if( status != 0 ) { /* has died with an error already */
+#if LUA_VERSION_NUM >= 504
+    close_thread( co, L ); /* (its error has been reported before) */
+#endif
+    return 0;
+  }
+#if LUA_VERSION_NUM >= 504
+  if( status != LUA_OK )
+    status = close_thread( co, L );
+#endif
+  if( status == 0 )
+    return 0;
+  if( status == LUA_YIELD ) {
+    lua_pushliteral( L, "coroutine keeps yielding after being closed" );
+    return 1;
+  }
+  if( lua_type( co, -1 ) == LUA_TSTRING &&
+      strcmp( lua_tostring( co, -1 ), "closed" ) == 0 )
+    return 0; /* the cancellation itself */
+  lua_xmove( co, L, 1 );
+  return 1;
+}
+
+
+/* cleanup function of a nursery: cancel all suspended children (and
+ * close the ones that died with an error) in reverse order in the
+ * preallocated cleanup thread */
+static int nursery_close( lua_State* L ) {
+  nursery* ns = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  int failed = 0;
+  ns->closed = 1;
+  lua_settop( L, 0 );
+  lua_getuservalue( L, lua_upvalueindex( 1 ) );
+  lua_pushnil( L ); /* first error */
+  for( ; ns->n > 0; ns->n-- ) {
+    lua_State* co = NULL;
+    lua_rawgeti( L, 1, (int)ns->n );
+    co = lua_tothread( L, -1 );
+    if( co != NULL && lua_status( co ) != 0 && cancel_thread( co, L ) ) {
+      if( !failed )
+        lua_replace( L, 2 );
+      else
+        lua_pop( L, 1 );
+      failed = 1;
+    }
+    lua_pop( L, 1 );
+    lua_pushnil( L );
+    lua_rawseti( L, 1, (int)ns->n );
+  }
+  if( failed )
+    lua_error( L );
+  return 0;
+}
+
+
+/* registry key for the (preallocated) error message for too many
+ * results of a main function */
+static char const overflow_key = 0;
+
+/* push the message without allocating memory; the stack of `L` may
+ * be exhausted, so it goes to the cleanup thread */
+static void push_overflow( lua_State* L2 ) {
+  lua_pushlightuserdata( L2, (void*)&overflow_key );
+  lua_rawget( L2, LUA_REGISTRYINDEX );
+}
+
+
+/* run the cleanup function of a scope in its thread by resuming the
+ * yielded coroutine; the error value is on top of `L` if `status`
+ * is non-zero; returns the status of the resume. Must not raise
+ * errors while `s` is linked into the scope chain. */
+static int scope_cleanup( lua_State* L, module_state* ms, scope* s,
+                          int status ) {
+  lua_State* L2 = s->L2;
+  int gcrunning = 0, hookmask = 0, nret = 0, status2 = 0;
+  int observed = 0, n = 0, overflow = 0, omask = 0, ocount = 0;
+  lua_Hook ohook = (lua_Hook)0;
+  s->done = 1;
+  lua_settop( L2, s->scratch );
+  if( status == 0 && s->results ) {
+    /* `s` lives on the C stack, so it must not be on the scope chain
+     * if an error escapes from here (checking the stack may raise
+     * on Lua 5.1) */
+    scope* current = ms->current;
+    ms->current = s->prev;
+    /* L: [ main | thread(s) | results ... ]; the reservation only
+     * has room for `s->results` of them */
+    n = lua_gettop( L )-s->nfixed;
+    if( n > s->results || !lua_checkstack( L, n ) ||
+        !lua_checkstack( L2, n ) ) {
+      overflow = 1;
+      n = 0;
+    }
+    ms->current = current;
+  }
+  if( overflow ) /* cleanup function gets an error instead */
+    push_overflow( L2 );
+  else if( status != 0 ) { /* pass error to cleanup function */
+    lua_pushvalue( L, -1 ); /* duplicate error message */
+    lua_xmove( L, L2, 1 ); /* move to thread */
+  } else if( s->scratch || s->results )
+    lua_pushnil( L2 );
+  if( s->scratch ) /* L2: [ error/nil | scratch table ] */
+    lua_insert( L2, 1 );
+  if( n > 0 ) { /* copy the results, they are returned as well */
+    int i = 0;
+    for( i = s->nfixed+1; i <= s->nfixed+n; i++ )
+      lua_pushvalue( L, i );
+    lua_xmove( L, L2, n );
+  }
+  if( s->nogc ) { /* no GC steps or finalizers during cleanup */
+#if LUA_VERSION_NUM > 501
+    gcrunning = lua_gc( L, LUA_GCISRUNNING, 0 ) > 0;
+#else
+    gcrunning = 1; /* Lua 5.1 can't tell */
+#endif
+    lua_gc( L, LUA_GCSTOP, 0 );
+  }
+  PROBE2( cleanup__start, L, (unsigned long)s->id );
+  if( s->observe ) {
+    observed = observe_begin( L, &ms->obs );
+    hookmask |= LUA_MASKLINE;
+  }
+  if( ms->smp != NULL && ms->smp->period > 0 )
+    hookmask |= LUA_MASKCOUNT;
+  if( hookmask ) { /* (replaces the hook inherited from `L`) */
+    ohook = lua_gethook( L2 );
+    omask = lua_gethookmask( L2 );
+    ocount = lua_gethookcount( L2 );
+    lua_sethook( L2, cleanup_hook, hookmask,
+                 ms->smp != NULL ? ms->smp->period : 0 );
+  }
+  status2 = lua_resume( L2, L, lua_gettop( L2 ), &nret );
+  if( hookmask )
+    lua_sethook( L2, ohook, omask, ocount );
+  if( s->observe )
+    observe_end( L, &ms->obs, observed );
+  PROBE3( cleanup__done, L, (unsigned long)s->id, status2 );
+  if( gcrunning )
+    lua_gc( L, LUA_GCRESTART, 0 );
+  if( s->as != NULL ) { /* reset memory allocation function */
+    alloc_state* as = s->as;
+    lua_setallocf( L, as->alloc, as->ud );
+  }
+  log_flush( &ms->log );
+  if( overflow && status2 == 0 ) { /* raise it like a cleanup error */
+    push_overflow( L2 );
+    status2 = LUA_ERRRUN;
+  }
+  return status2;
+}
+
+
+/* read `opts[ branch ][ field ]` (0 if missing) */
+static lua_Integer branch_option( lua_State* L, int idx,
+                                  char const* branch,
+                                  char const* field ) {
+  lua_Integer v = 0;
+  lua_getfield( L, idx, branch );
+  if( lua_istable( L, -1 ) ) {
+    lua_getfield( L, -1, field );
+    v = luaL_optinteger( L, -1, 0 );
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, 1 );
+  return v;
+}
+
+
+/* preallocate stack frames and stack slots in thread `L2` for the
+ * cleanup function at index `idx`, and leave it yielded */
+static void prepare_cleanup( lua_State* L, module_state* ms,
+                             lua_State* L2, int idx,
+                             lua_Integer minstack,
+                             lua_Integer mincalls, alloc_state* as ) {
+  int status = 0, nret = 0;
+#if LUA_VERSION_NUM > 501
+  mincalls += 1; /* stack frame(s) used internally */
+  lua_pushcfunction( L2, preallocate );
+#else
+  /* Lua 5.1 doesn't support yieldable C functions, so we use a Lua
+   * closure to preallocate stack and call frames. This only allocates
+   * *Lua* call frames though, not C call frames, so you could hit a
+   * limit there while executing the cleanup function later!
    * Also we can't preallocate a variable amount of stack slots so
    * that they won't cause a panic on memory allocation failure *and*
    * survive a garbage collection cycle during the main function.
@@ -206,47 +2265,416 @@ static int lfinally( lua_State* L ) {
   lua_pushvalue( L2, -1 );
   lua_pushinteger( L2, mincalls );
   lua_pushinteger( L2, minstack );
-  if( debug ) {
-    as.alloc = lua_getallocf( L, &as.ud );
-    lua_pushlightuserdata( L2, &as );
-  } else
+  if( as != NULL )
+    lua_pushlightuserdata( L2, as );
+  else
     lua_pushnil( L2 );
-  lua_pushvalue( L, 2 ); /* clean up function */
+  lua_pushvalue( L, idx ); /* clean up function */
   lua_xmove( L, L2, 1 );
-  lua_replace( L, 2 ); /* L: [ function | thread ] */
   /* preallocate stack frames and stack slots for cleanup function,
    * and then yield ... */
+#if FINALLY_MMAP
+  if( ms->region != NULL )
+    ms->region->routing = 1;
+#endif
   status = lua_resume( L2, L, 5, &nret );
+#if FINALLY_MMAP
+  if( ms->region != NULL )
+    ms->region->routing = 0;
+#else
+  (void)ms;
+#endif
   if( status != LUA_YIELD ) { /* must be an error */
     lua_xmove( L2, L, 1 );
     lua_error( L );
   }
-  /* run main function */
-  lua_pushvalue( L, 1 );
-  status = lua_pcall( L, 0, LUA_MULTRET, 0 );
-  /* run cleanup function in the other thread by resuming yielded
-   * coroutine */
-  lua_settop( L2, 0 );
-  if( status != 0 ) { /* pass error to cleanup function */
-    lua_pushvalue( L, -1 ); /* duplicate error message */
-    lua_xmove( L, L2, 1 ); /* move to thread */
+}
+
+
+/* options of a `finally` call (also for transactions and loops) */
+typedef struct {
+  lua_Integer stack;
+  lua_Integer calls;
+  lua_Integer narr;
+  lua_Integer nrec;
+  int         debug;
+  int         nogc;
+  int         results;
+} call_options;
+
+
+/* parse the options table or the positional options starting at
+ * index `idx`, and remove them from the stack */
+static void get_options( lua_State* L, int idx, call_options* opt ) {
+  if( lua_istable( L, idx ) ) { /* options table */
+    lua_settop( L, idx );
+    lua_getfield( L, idx, "stack" );
+    lua_getfield( L, idx, "calls" );
+    lua_getfield( L, idx, "debug" );
+    lua_getfield( L, idx, "narr" );
+    lua_getfield( L, idx, "nrec" );
+    lua_getfield( L, idx, "nogc" );
+    lua_getfield( L, idx, "results" );
+    lua_remove( L, idx );
   }
-  status2 = lua_resume( L2, L, !!status, &nret );
-  if( debug ) /* reset memory allocation function */
-    lua_setallocf( L, as.alloc, as.ud );
+  opt->stack = luaL_optinteger( L, idx, 100 );
+  luaL_argcheck( L, opt->stack > 0, idx,
+                 "invalid number of reserved stack slots" );
+  opt->calls = luaL_optinteger( L, idx+1, 10 );
+  luaL_argcheck( L, opt->calls > 0, idx+1,
+                 "invalid minimum number of call frames" );
+  opt->debug = lua_toboolean( L, idx+2 );
+  opt->narr = luaL_optinteger( L, idx+3, 0 );
+  luaL_argcheck( L, opt->narr >= 0 && opt->narr <= INT_MAX, idx+3,
+                 "invalid scratch table size" );
+  opt->nrec = luaL_optinteger( L, idx+4, 0 );
+  luaL_argcheck( L, opt->nrec >= 0 && opt->nrec <= INT_MAX, idx+4,
+                 "invalid scratch table size" );
+  opt->nogc = lua_toboolean( L, idx+5 );
+  opt->results = 0;
+  if( lua_type( L, idx+6 ) == LUA_TNUMBER ) {
+    lua_Integer r = luaL_checkinteger( L, idx+6 );
+    luaL_argcheck( L, r >= 0 && r <= 1000000, idx+6,
+                   "invalid number of results" );
+    opt->results = (int)r;
+  } else if( lua_toboolean( L, idx+6 ) )
+    opt->results = FINALLY_RESULTS;
+  lua_settop( L, idx-1 );
+}
+
+
+/* the part of a `finally` call after the preallocation: call the
+ * main function (also at index `fidx`) with the `nargs` arguments on
+ * top of `L` in the scope `sc` (already entered), then the cleanup function in `sc->L2` (or
+ * in `L2ok` if given and the main function succeeded), and raise any
+ * error; `t0` is the start time of the call */
+static void run_call( lua_State* L, module_state* ms, scope* sc,
+                      int fidx, int nargs, int nresults,
+                      lua_State* L2ok, stat_time t0 ) {
+  int status = 0, status2 = 0, status3 = 0;
+  int profile = 0, installed = 0;
+  alloc_site* outer = NULL;
+#if FINALLY_STATS
+  stat_time t1 = 0;
+#endif
+#if FINALLY_TRACE
+  trace_call tc;
+#endif
+  (void)t0;
+  STATS_NOW( t1 );
+  STATS_ADD( STAT_CALLS, 1 );
+  STATS_ADD( STAT_PREALLOC_NS, t1-t0 );
+  TRACE_BEGIN( ms, &tc, sc->id );
+  if( ms->prof.enabled ) {
+    profile = 1;
+    installed = profile_begin( L, &ms->prof, fidx, &outer );
+  }
+  status = lua_pcall( L, nargs, nresults, 0 );
+  if( profile )
+    profile_end( L, &ms->prof, outer, installed );
+  PROBE3( main__done, L, (unsigned long)sc->id, status );
+  TRACE_MAIN( &tc, status );
+  STATS_NOW( t0 );
+  STATS_ADD( STAT_MAIN_NS, t0-t1 );
+  if( status != 0 )
+    STATS_ADD( STAT_ERRORS, 1 );
+  if( L2ok != NULL && status == 0 )
+    sc->L2 = L2ok;
+  if( !sc->done ) /* unless drained */
+    status2 = scope_cleanup( L, ms, sc, status );
+  STATS_NOW( t1 );
+  STATS_ADD( STAT_CLEANUP_NS, t1-t0 );
+  STATS_HIST( t1-t0 );
+  status3 = scope_leave( L, ms, sc );
+  TRACE_END( &tc, status2 != 0 ? status2 : status3 );
+  if( status2 != 0 || status3 != 0 )
+    STATS_ADD( STAT_CLEANUP_ERRORS, 1 );
   if( status2 == LUA_YIELD ) {
     /* cleanup function shouldn't yield; can only happen in Lua 5.1 */
     lua_settop( L, 0 ); /* make room */
-    lua_pushvalue( L, lua_upvalueindex( 1 ) );
+    lua_pushvalue( L, lua_upvalueindex( 2 ) );
     lua_error( L );
   } else if( status2 != 0 ) { /* error in cleanup function */
     lua_settop( L, 0 ); /* make room */
-    lua_xmove( L2, L, 1 ); /* error message from other thread */
+    lua_xmove( sc->L2, L, 1 ); /* error message from other thread */
     lua_error( L );
   }
+  if( status3 != 0 ) /* error while releasing bound resources */
+    lua_error( L );
   if( status != 0 )
     lua_error( L ); /* re-raise error from main function */
-  return lua_gettop( L )-2; /* return results from main function */
+}
+
+
+/* implementation of `finally( main, cleanup, ... )` and
+ * `finally.transaction( main, on_success, on_error, opts )`; the
+ * latter uses separate threads for the two cleanup functions */
+static int finally_impl( lua_State* L, int transaction ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  scope sc;
+  call_options opt;
+  lua_Integer okstack = 0, okcalls = 0, errstack = 0, errcalls = 0;
+  int scratch = 0, observe = 0;
+  int o = transaction ? 3 : 2; /* index of last fixed argument */
+  alloc_state as = { 0, 0 };
+  lua_State* L2 = NULL;
+  lua_State* L2ok = NULL;
+  stat_time t0 = 0;
+  PROBE1( entry, L );
+  STATS_NOW( t0 );
+  luaL_checktype( L, 1, LUA_TFUNCTION );
+  luaL_checktype( L, 2, LUA_TFUNCTION );
+  if( transaction ) {
+    luaL_checktype( L, 3, LUA_TFUNCTION );
+    if( !lua_isnoneornil( L, 4 ) )
+      luaL_checktype( L, 4, LUA_TTABLE );
+    if( lua_istable( L, 4 ) ) {
+      okstack = branch_option( L, 4, "success", "stack" );
+      okcalls = branch_option( L, 4, "success", "calls" );
+      errstack = branch_option( L, 4, "error", "stack" );
+      errcalls = branch_option( L, 4, "error", "calls" );
+    }
+  }
+  get_options( L, o+1, &opt );
+  luaL_argcheck( L, okstack >= 0 && okcalls >= 0 && errstack >= 0 &&
+                 errcalls >= 0, o+1, "invalid reservation" );
+  scratch = opt.narr > 0 || opt.nrec > 0;
+  if( !opt.debug && ms->obs.every > 0 )
+    observe = ++ms->obs.calls % ms->obs.every == 0;
+  if( opt.debug )
+    as.alloc = lua_getallocf( L, &as.ud );
+  /* prepare thread(s) to run the cleanup function(s) */
+  L2 = lua_newthread( L );
+  /* (the results of main are passed to the success cleanup only) */
+  prepare_cleanup( L, ms, L2, transaction ? 3 : 2,
+                   (errstack ? errstack : opt.stack) +
+                     (transaction ? 0 : opt.results),
+                   errcalls ? errcalls : opt.calls,
+                   opt.debug ? &as : NULL );
+  if( transaction ) {
+    L2ok = lua_newthread( L );
+    prepare_cleanup( L, ms, L2ok, 2,
+                     (okstack ? okstack : opt.stack)+opt.results,
+                     okcalls ? okcalls : opt.calls,
+                     opt.debug ? &as : NULL );
+    lua_replace( L, 2 );
+  }
+  lua_replace( L, o ); /* L: [ main | thread(s) ] */
+  if( scratch ) { /* the scratch table waits in the other thread(s) */
+    lua_createtable( L, (int)opt.narr, (int)opt.nrec );
+    if( transaction ) {
+      lua_pushvalue( L, -1 );
+      lua_xmove( L, L2ok, 1 );
+    }
+    lua_xmove( L, L2, 1 );
+  }
+  PROBE3( prealloc, L, (long)opt.stack, (long)opt.calls );
+  /* run main function */
+  scope_enter( ms, &sc );
+  sc.L2 = L2;
+  sc.as = opt.debug ? &as : NULL;
+  sc.scratch = scratch;
+  sc.nogc = opt.nogc;
+  sc.observe = observe;
+  sc.results = opt.results;
+  sc.nfixed = o;
+  lua_pushvalue( L, 1 );
+  run_call( L, ms, &sc, 1, 0, LUA_MULTRET, L2ok, t0 );
+  return lua_gettop( L )-o; /* return results from main function */
+}
+
+
+static int lfinally( lua_State* L ) {
+  return finally_impl( L, 0 );
+}
+
+
+/* `finally.transaction( main, on_success, on_error [, opts] )` runs
+ * only one of the two cleanup functions, each with a reservation of
+ * its own */
+static int ltransaction( lua_State* L ) {
+  return finally_impl( L, 1 );
+}
+
+
+/* `finally.loop( n, body, cleanup [, opts] )` calls `body( i )` for
+ * `i` from 1 to `n`, each followed by the cleanup function, which runs
+ * in the same coroutine every time: after every cleanup the
+ * coroutine is re-armed, which reuses the stack slots and call frames
+ * allocated for the previous iteration */
+static int lloop( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  scope sc;
+  call_options opt;
+  lua_Integer n = luaL_checkinteger( L, 1 ), i = 0;
+  int scratch = 0;
+  alloc_state as = { 0, 0 };
+  lua_State* L2 = NULL;
+  stat_time t0 = 0;
+  luaL_checktype( L, 2, LUA_TFUNCTION );
+  luaL_checktype( L, 3, LUA_TFUNCTION );
+  get_options( L, 4, &opt );
+  scratch = opt.narr > 0 || opt.nrec > 0;
+  if( opt.debug )
+    as.alloc = lua_getallocf( L, &as.ud );
+  if( n <= 0 )
+    return 0;
+  /* L: [ n | body | cleanup | thread | scratch table ] */
+  L2 = lua_newthread( L );
+  if( scratch )
+    lua_createtable( L, (int)opt.narr, (int)opt.nrec );
+  else
+    lua_pushnil( L );
+  for( i = 1; i <= n; i++ ) {
+    PROBE1( entry, L );
+    STATS_NOW( t0 );
+    /* (re-)arm the thread for the cleanup function */
+    lua_settop( L, 5 );
+    lua_settop( L2, 0 );
+    prepare_cleanup( L, ms, L2, 3, opt.stack+opt.results, opt.calls,
+                     opt.debug ? &as : NULL );
+    if( scratch ) { /* the scratch table is reused */
+      lua_pushvalue( L, 5 );
+      lua_xmove( L, L2, 1 );
+    }
+    PROBE3( prealloc, L, (long)opt.stack, (long)opt.calls );
+    scope_enter( ms, &sc );
+    sc.L2 = L2;
+    sc.as = opt.debug ? &as : NULL;
+    sc.scratch = scratch;
+    sc.nogc = opt.nogc;
+    if( !opt.debug && ms->obs.every > 0 )
+      sc.observe = ++ms->obs.calls % ms->obs.every == 0;
+    sc.results = opt.results;
+    sc.nfixed = 5;
+    lua_pushvalue( L, 2 );
+    lua_pushinteger( L, i );
+    run_call( L, ms, &sc, 2, 1, opt.results ? LUA_MULTRET : 0, NULL,
+              t0 );
+    if( sc.drained ) /* stop after this iteration */
+      break;
+  }
+  return 0;
+}
+
+
+/* elapsed (wall clock) time in seconds for `finally.drain`; falls
+ * back to processor time if there is no monotonic clock */
+static double drain_now( void ) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+
+/* `finally.drain( [e] )` runs the cleanup functions of all active
+ * `finally` calls right away (innermost first, passing `e` or
+ * "drained" as error value) and releases their bound resources;
+ * returns the number of cleanup functions run, the number of errors,
+ * and the elapsed time in seconds */
+static int ldrain( lua_State* L ) {
+  module_state* ms = lua_touserdata( L, lua_upvalueindex( 1 ) );
+  double t0 = drain_now();
+  int n = 0, errors = 0;
+  scope* s = NULL;
+  if( lua_isnoneornil( L, 1 ) ) {
+    lua_settop( L, 0 );
+    lua_pushliteral( L, "drained" );
+  } else
+    lua_settop( L, 1 );
+  /* main functions can't yield across `finally` calls, so all pending
+   * scopes of this Lua state (the module state is shared by all
+   * instances of the module) are on this chain */
+  for( s = ms->current; s != NULL; s = s->prev ) {
+    if( s->drained ) /* by an earlier drain */
+      continue;
+    s->drained = 1;
+    if( !s->done && s->L2 != NULL ) {
+      void* ud = NULL;
+      lua_Alloc alloc = lua_getallocf( L, &ud );
+      if( scope_cleanup( L, ms, s, 1 ) != 0 )
+        errors++;
+      lua_setallocf( L, alloc, ud );
+      n++;
+    }
+    /* the main function may still be running, so scratch buffers
+     * are invalidated, and pooled objects are dropped instead of
+     * being reused */
+    arena_free( s );
+    if( release_resources( L, ms, s->base, 1 ) != 0 ) {
+      errors++;
+      lua_pop( L, 1 );
+    }
+  }
+  lua_pushinteger( L, n );
+  lua_pushinteger( L, errors );
+  lua_pushnumber( L, (lua_Number)(drain_now()-t0) );
+  return 3;
+}
+
+
+/* `finally.nursery( body [, opts] )` calls `body( spawn )` like the
+ * main function of a `finally` call; all coroutines created via
+ * `spawn` are closed in the cleanup function */
+static int lnursery( lua_State* L ) {
+  nursery* ns = NULL;
+  lua_Integer size = 16;
+  luaL_checktype( L, 1, LUA_TFUNCTION );
+  lua_settop( L, 2 );
+  if( lua_istable( L, 2 ) ) {
+    lua_getfield( L, 2, "children" );
+    size = luaL_optinteger( L, -1, 16 );
+    lua_pop( L, 1 );
+  } else if( !lua_isnil( L, 2 ) )
+    luaL_checktype( L, 2, LUA_TTABLE );
+  luaL_argcheck( L, size >= 0 && size <= INT_MAX, 2,
+                 "invalid number of children" );
+  ns = lua_newuserdata( L, sizeof( nursery ) );
+  ns->n = 0;
+  ns->closed = 0;
+  lua_createtable( L, (int)size, 0 ); /* preallocated array */
+  lua_setuservalue( L, -2 );
+  lua_pushvalue( L, 1 );
+  lua_pushvalue( L, -2 );
+  lua_pushcclosure( L, nursery_spawn, 1 );
+  lua_pushcclosure( L, nursery_main, 2 );
+  lua_replace( L, 1 );
+  lua_pushcclosure( L, nursery_close, 1 );
+  lua_insert( L, 2 ); /* L: [ main | cleanup | opts ] */
+  return lfinally( L );
+}
+
+
+/* the static analysis tools are implemented in Lua and loaded on
+ * demand */
+static int delegate( lua_State* L, char const* name ) {
+  lua_getglobal( L, "require" );
+  lua_pushliteral( L, "finally.analyze" );
+  lua_call( L, 1, 1 );
+  lua_getfield( L, -1, name );
+  lua_replace( L, -2 );
+  lua_insert( L, 1 );
+  lua_call( L, lua_gettop( L )-1, LUA_MULTRET );
+  return lua_gettop( L );
+}
+
+static int lanalyze( lua_State* L ) {
+  return delegate( L, "analyze" );
+}
+
+static int lreserve( lua_State* L ) {
+  return delegate( L, "reserve" );
+}
+
+
+/* `finally( main, cleanup, ... )` calls the module table */
+static int lcall( lua_State* L ) {
+  lua_remove( L, 1 );
+  return lfinally( L );
 }
 
 
@@ -254,9 +2682,142 @@ static int lfinally( lua_State* L ) {
 #  define EXPORT extern
 #endif
 
+/* registry key for the module state */
+static char const module_key[] = "finally.state";
+
+
+/* L: [ module table | module state | yield error message ] */
+static int module_functions( lua_State* L, luaL_Reg const* functions,
+                             luaL_Reg const* metamethods ) {
+  lua_newtable( L ); /* metatable */
+  lua_pushvalue( L, -3 );
+  lua_pushvalue( L, -3 );
+  luaL_setfuncs( L, metamethods, 2 );
+  lua_setmetatable( L, -4 );
+  luaL_setfuncs( L, functions, 2 );
+  return 1;
+}
+
+
 EXPORT int luaopen_finally( lua_State* L ) {
+  static luaL_Reg const functions[] = {
+    { "log", llog },
+    { "analyze", lanalyze },
+    { "reserve", lreserve },
+    { "scratch", lscratch },
+    { "pool", lpool },
+    { "observe", lobserve },
+    { "violations", lviolations },
+    { "profile", lprofile },
+    { "hotspots", lhotspots },
+    { "sample", lsample },
+    { "stacks", lstacks },
+    { "drain", ldrain },
+    { "nursery", lnursery },
+    { "transaction", ltransaction },
+    { "loop", lloop },
+    { "open", lopen },
+#if FINALLY_MMAP
+    { "mmap", lmmap },
+    { "prefault", lprefault },
+#endif
+#if FINALLY_TRACE
+    { "trace", ltrace },
+#endif
+#if FINALLY_STATS
+    { "stats", lstats },
+#endif
+    { NULL, NULL }
+  };
+  static luaL_Reg const metamethods[] = {
+    { "__call", lcall },
+    { NULL, NULL }
+  };
+  static luaL_Reg const scratch_methods[] = {
+    { "__len", scratch_size },
+    { "size", scratch_size },
+    { "byte", scratch_byte },
+    { "sub", scratch_sub },
+    { "set", scratch_set },
+    { NULL, NULL }
+  };
+#if FINALLY_MMAP
+  static luaL_Reg const mmap_methods[] = {
+    { "__len", mmap_size },
+    { "__gc", mmap_release },
+    { "size", mmap_size },
+    { "byte", mmap_byte },
+    { "sub", mmap_sub },
+    { NULL, NULL }
+  };
+#endif
+  static luaL_Reg const pool_methods[] = {
+    { "acquire", pool_acquire },
+    { "stats", pool_stats },
+    { NULL, NULL }
+  };
+  module_state* ms = NULL;
+#if FINALLY_STATS
+  stats_open();
+#endif
+  lua_newtable( L ); /* module table */
+  /* upvalues shared by all functions; the module state is anchored in
+   * the registry and shared by all instances of the module, so that
+   * `finally.drain` sees every pending scope of the Lua state */
+  lua_pushlightuserdata( L, (void*)module_key );
+  lua_rawget( L, LUA_REGISTRYINDEX );
   lua_pushliteral( L, "'finally' cleanup function shouldn't yield" );
-  lua_pushcclosure( L, lfinally, 1 );
-  return 1;
+  if( lua_type( L, -2 ) == LUA_TUSERDATA )
+    return module_functions( L, functions, metamethods );
+  lua_remove( L, -2 );
+  ms = lua_newuserdata( L, sizeof( module_state ) );
+  lua_insert( L, -2 );
+  lua_pushlightuserdata( L, (void*)module_key );
+  lua_pushvalue( L, -3 );
+  lua_rawset( L, LUA_REGISTRYINDEX );
+  ms->current = NULL;
+  ms->nscopes = 0;
+  ms->nresources = 0;
+  ms->log.n = 0;
+  ms->log.truncated = 0;
+  memset( &ms->obs, 0, sizeof( ms->obs ) );
+  memset( &ms->prof, 0, sizeof( ms->prof ) );
+  ms->smp = NULL;
+#if FINALLY_TRACE
+  ms->trace = NULL;
+#endif
+#if FINALLY_MMAP
+  ms->region = NULL;
+#endif
+  luaL_newmetatable( L, SCRATCH_NAME );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pushvalue( L, -3 );
+  lua_pushvalue( L, -3 );
+  luaL_setfuncs( L, scratch_methods, 2 );
+  lua_pop( L, 1 );
+  luaL_newmetatable( L, POOL_NAME );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  lua_pushvalue( L, -3 );
+  lua_pushvalue( L, -3 );
+  luaL_setfuncs( L, pool_methods, 2 );
+  lua_pop( L, 1 );
+#if FINALLY_MMAP
+  luaL_newmetatable( L, MMAP_NAME );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  luaL_setfuncs( L, mmap_methods, 0 );
+  lua_pop( L, 1 );
+#endif
+  /* stack of resources bound to active scopes */
+  lua_pushlightuserdata( L, (void*)ms );
+  lua_newtable( L );
+  lua_rawset( L, LUA_REGISTRYINDEX );
+  lua_pushlightuserdata( L, (void*)&overflow_key );
+  lua_pushliteral( L, "too many results for 'finally' cleanup "
+                      "function" );
+  lua_rawset( L, LUA_REGISTRYINDEX );
+  return module_functions( L, functions, metamethods );
 }
 
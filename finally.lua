@@ -1,18 +1,367 @@
-local pcall, error = pcall, error
+local pcall, error, select, type, tostring, setmetatable, require =
+      pcall, error, select, type, tostring, setmetatable, require
+local getmetatable, collectgarbage, load = getmetatable, collectgarbage, load
+local newproxy = newproxy -- Lua 5.1 only
+local pairs, clock = pairs, os.clock
+local running, status = coroutine.running, coroutine.status
+local create, close = coroutine.create, coroutine.close -- Lua 5.4
+local concat, stderr = table.concat, io.stderr
+local V = _VERSION
 
-local function _finally( after, ok, ... )
+local M = {}
+
+local logbuf, logn = {}, 0
+
+function M.log( ... )
+  for i = 1, select( '#', ... ) do
+    local v = select( i, ... )
+    local t = type( v )
+    if t ~= "string" and t ~= "number" and t ~= "boolean" then
+      v = t
+    end
+    logn = logn + 1
+    logbuf[ logn ] = tostring( v )
+  end
+end
+
+function M.analyze( ... )
+  return require( "finally.analyze" ).analyze( ... )
+end
+
+function M.reserve( ... )
+  return require( "finally.analyze" ).reserve( ... )
+end
+
+local function flush()
+  if logn > 0 then
+    stderr:write( concat( logbuf, "", 1, logn ) )
+    stderr:flush()
+    for i = logn, 1, -1 do logbuf[ i ] = nil end
+    logn = 0
+  end
+end
+
+
+-- stacks of pending cleanups for every coroutine; they are only
+-- kept once `cancel`, `drain`, `nursery`, or `track` has been looked
+-- up, so that plain `finally` calls don't allocate anything extra
+local mainthread = {} -- key for the main thread in Lua 5.1
+local active = setmetatable( {}, { __mode = "k" } )
+local scopemeta = {}
+local tracking = false
+
+
+local function cleanup( scope, failed, e, ... )
+  local ok, e2, gcrunning
+  local after = not failed and scope.success or scope.after
+  scope.done = true
+  if scope.nogc then
+    gcrunning = V == "Lua 5.1" or collectgarbage( "isrunning" )
+    collectgarbage( "stop" )
+  end
+  if scope.results and not failed then
+    if scope.scratch then
+      ok, e2 = pcall( after, nil, scope.scratch, ... )
+    else
+      ok, e2 = pcall( after, nil, ... )
+    end
+  elseif scope.scratch then
+    if failed then
+      ok, e2 = pcall( after, e, scope.scratch )
+    else
+      ok, e2 = pcall( after, nil, scope.scratch )
+    end
+  elseif failed then
+    ok, e2 = pcall( after, e )
+  else
+    ok, e2 = pcall( after )
+  end
+  if gcrunning then
+    collectgarbage( "restart" )
+  end
+  flush()
+  return ok, e2
+end
+
+
+local function pop( scope )
+  local stack = scope.stack
+  if stack and stack[ stack.n ] == scope then
+    stack[ stack.n ] = nil
+    stack.n = stack.n - 1
+  end
+end
+
+
+-- run all pending cleanups of a coroutine
+local function drop( stack, e )
+  local n, ok, err, errors = 0, true, nil, 0
+  while stack.n > 0 do
+    local scope = stack[ stack.n ]
+    stack[ stack.n ] = nil
+    stack.n = stack.n - 1
+    if not scope.done then
+      local ok2, e2 = cleanup( scope, true, e )
+      if not ok2 then
+        if ok then
+          ok, err = false, e2
+        end
+        errors = errors + 1
+      end
+      n = n + 1
+    end
+  end
+  return n, ok, err, errors
+end
+
+
+-- runs the pending cleanups when the coroutine is collected (or the
+-- Lua state is closed)
+local function sentinel( stack )
+  local function gc()
+    drop( stack, "closed" )
+  end
+  if newproxy then
+    local p = newproxy( true )
+    getmetatable( p ).__gc = gc
+    return p
+  else
+    return setmetatable( {}, { __gc = gc } )
+  end
+end
+
+
+-- runs the pending cleanup when the coroutine is closed (Lua 5.4)
+function scopemeta.__close( scope, e )
+  if not scope.done then
+    pop( scope )
+    local ok, e2 = cleanup( scope, true, e == nil and "closed" or e )
+    if not ok then
+      error( e2, 0 )
+    end
+  end
+end
+
+
+local function _finally( scope, ok, ... )
+  pop( scope )
+  if not scope.done then -- not cancelled
+    local ok2, e
+    if ok then
+      ok2, e = cleanup( scope, false, nil, ... )
+    else
+      ok2, e = cleanup( scope, true, (...) )
+    end
+    if not ok2 then
+      error( e, 0 )
+    end
+  end
   if ok then
-    after()
     return ...
   else
-    after( (...) )
     error( (...), 0 )
   end
 end
 
-local function finally( main, after )
-  return _finally( after, pcall( main ) )
+local function enter( after, opts, success )
+  local scope = setmetatable( { after = after, success = success },
+                              scopemeta )
+  if type( opts ) == "table" then
+    if (opts.narr or 0) > 0 or (opts.nrec or 0) > 0 then
+      scope.scratch = {}
+    end
+    scope.nogc = opts.nogc
+    scope.results = opts.results
+  end
+  if tracking then
+    local co = running() or mainthread
+    local stack = active[ co ]
+    if not stack then
+      stack = { n = 0 }
+      stack.sentinel = sentinel( stack )
+      active[ co ] = stack
+    end
+    stack.n = stack.n + 1
+    stack[ stack.n ] = scope
+    scope.stack = stack
+  end
+  return scope
 end
 
-return finally
+-- the fast path without a scope (no options, and no tracking)
+local function _plain( after, ok, ... )
+  local ok2, e
+  if ok then
+    ok2, e = pcall( after )
+  else
+    ok2, e = pcall( after, (...) )
+  end
+  flush()
+  if not ok2 then
+    error( e, 0 )
+  end
+  if ok then
+    return ...
+  else
+    error( (...), 0 )
+  end
+end
+
+-- call `main( ... )` within the given (new) scope
+local function run( scope, main, ... )
+  return _finally( scope, pcall( main, ... ) )
+end
+
+if V == "Lua 5.4" then -- closing a coroutine also runs the cleanup
+  run = load( [[
+    local _finally, pcall = ...
+    return function( scope, main, ... )
+      local s <close> = scope
+      return _finally( s, pcall( main, ... ) )
+    end
+  ]], "=finally" )( _finally, pcall )
+end
+
+local function finally( main, after, opts )
+  if tracking or type( opts ) == "table" then
+    return run( enter( after, opts ), main )
+  end
+  return _plain( after, pcall( main ) )
+end
+
+
+local function _transaction( on_success, on_error, ok, ... )
+  if ok then
+    return _plain( on_success, ok, ... )
+  else
+    return _plain( on_error, ok, ... )
+  end
+end
+
+-- like `finally`, but with separate cleanup functions for success
+-- and failure of the main function
+function M.transaction( main, on_success, on_error, opts )
+  if type( on_success ) ~= "function" then
+    error( "bad argument #2 to 'transaction' (function expected)", 2 )
+  end
+  if tracking or type( opts ) == "table" then
+    return run( enter( on_error, opts, on_success ), main )
+  end
+  return _transaction( on_success, on_error, pcall( main ) )
+end
+
+
+-- call `body( i )` for `i` from 1 to `n`, each followed by the
+-- cleanup function
+function M.loop( n, body, cleanup, opts )
+  local plain = not tracking and type( opts ) ~= "table"
+  for i = 1, n do
+    if plain then
+      _plain( cleanup, pcall( body, i ) )
+    else
+      run( enter( cleanup, opts ), body, i )
+    end
+  end
+end
+
+
+-- functions that need the scopes, see `tracking` above
+local lazy = {}
+
+-- start keeping track of the scopes
+function M.track()
+  tracking = true
+end
+
+
+-- run the pending cleanups of a suspended coroutine
+function lazy.cancel( co, e )
+  if type( co ) ~= "thread" then
+    error( "bad argument #1 to 'cancel' (thread expected)", 2 )
+  end
+  local st = status( co )
+  if st ~= "suspended" and st ~= "dead" then
+    error( "cannot cancel a "..st.." coroutine", 2 )
+  end
+  if e == nil then e = "cancelled" end
+  local stack = active[ co ]
+  if not stack then
+    return 0
+  end
+  local n, ok, err = drop( stack, e )
+  if not ok then
+    error( err, 0 )
+  end
+  return n
+end
+
+
+-- run the pending cleanups of all coroutines (e.g. on shutdown)
+function lazy.drain( e )
+  local t0, n, errors = clock(), 0, 0
+  if e == nil then e = "drained" end
+  -- cleanup functions may create new coroutines, so don't modify
+  -- `active` while traversing it
+  local stacks, k = {}, 0
+  for _,stack in pairs( active ) do
+    k = k + 1
+    stacks[ k ] = stack
+  end
+  for i = 1, k do
+    local n2, _, _, errors2 = drop( stacks[ i ], e )
+    n, errors = n + n2, errors + errors2
+  end
+  return n, errors, clock() - t0
+end
+
+
+-- call `body( spawn )` and clean up all coroutines created via
+-- `spawn` afterwards
+function lazy.nursery( body, opts )
+  local children, closed = {}, false
+  local function spawn( f )
+    if closed then
+      error( "nursery is closed", 2 )
+    end
+    local co = create( f )
+    children[ #children+1 ] = co
+    return co
+  end
+  return finally( function()
+    return body( spawn )
+  end, function()
+    local ok, err = true, nil
+    closed = true
+    for i = #children, 1, -1 do
+      local co = children[ i ]
+      children[ i ] = nil
+      if status( co ) == "suspended" then
+        local ok2, e2 = pcall( lazy.cancel, co, "closed" )
+        if ok2 and close then
+          ok2, e2 = close( co )
+        end
+        if not ok2 and ok then
+          ok, err = false, e2
+        end
+      end
+    end
+    if not ok then
+      error( err, 0 )
+    end
+  end, opts )
+end
+
+
+return setmetatable( M, {
+  __call = function( _, ... )
+    return finally( ... )
+  end,
+  __index = function( _, k )
+    local f = lazy[ k ]
+    if f then
+      tracking = true
+    end
+    return f
+  end
+} )
 
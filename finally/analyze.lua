@@ -0,0 +1,511 @@
+-- Static analysis of cleanup functions for the `finally` module.
+-- The bytecode produced by `string.dump` is parsed, and instructions
+-- that may allocate memory are reported together with their source
+-- line. Lua functions that are referenced via upvalues or global
+-- variables are analyzed as well (also in nested closures, as far as
+-- their upvalues refer to upvalues of the analyzed function rather
+-- than to its local variables). The same information is used to
+-- compute the number of stack slots and call frames to reserve for
+-- a cleanup function.
+
+local error, type, rawget, setmetatable =
+      error, type, rawget, setmetatable
+local floor = math.floor
+local byte, sub, dump = string.byte, string.sub, string.dump
+local getinfo, getupvalue = debug.getinfo, debug.getupvalue
+local getfenv = getfenv -- Lua 5.1 only
+
+
+local opnames = {
+  [ 0x51 ] = {
+    "MOVE", "LOADK", "LOADBOOL", "LOADNIL", "GETUPVAL", "GETGLOBAL",
+    "GETTABLE", "SETGLOBAL", "SETUPVAL", "SETTABLE", "NEWTABLE",
+    "SELF", "ADD", "SUB", "MUL", "DIV", "MOD", "POW", "UNM", "NOT",
+    "LEN", "CONCAT", "JMP", "EQ", "LT", "LE", "TEST", "TESTSET",
+    "CALL", "TAILCALL", "RETURN", "FORLOOP", "FORPREP", "TFORLOOP",
+    "SETLIST", "CLOSE", "CLOSURE", "VARARG",
+  },
+  [ 0x52 ] = {
+    "MOVE", "LOADK", "LOADKX", "LOADBOOL", "LOADNIL", "GETUPVAL",
+    "GETTABUP", "GETTABLE", "SETTABUP", "SETUPVAL", "SETTABLE",
+    "NEWTABLE", "SELF", "ADD", "SUB", "MUL", "DIV", "MOD", "POW",
+    "UNM", "NOT", "LEN", "CONCAT", "JMP", "EQ", "LT", "LE", "TEST",
+    "TESTSET", "CALL", "TAILCALL", "RETURN", "FORLOOP", "FORPREP",
+    "TFORCALL", "TFORLOOP", "SETLIST", "CLOSURE", "VARARG",
+    "EXTRAARG",
+  },
+  [ 0x53 ] = {
+    "MOVE", "LOADK", "LOADKX", "LOADBOOL", "LOADNIL", "GETUPVAL",
+    "GETTABUP", "GETTABLE", "SETTABUP", "SETUPVAL", "SETTABLE",
+    "NEWTABLE", "SELF", "ADD", "SUB", "MUL", "MOD", "POW", "DIV",
+    "IDIV", "BAND", "BOR", "BXOR", "SHL", "SHR", "UNM", "BNOT", "NOT",
+    "LEN", "CONCAT", "JMP", "EQ", "LT", "LE", "TEST", "TESTSET",
+    "CALL", "TAILCALL", "RETURN", "FORLOOP", "FORPREP", "TFORCALL",
+    "TFORLOOP", "SETLIST", "CLOSURE", "VARARG", "EXTRAARG",
+  },
+  [ 0x54 ] = {
+    "MOVE", "LOADI", "LOADF", "LOADK", "LOADKX", "LOADFALSE",
+    "LFALSESKIP", "LOADTRUE", "LOADNIL", "GETUPVAL", "SETUPVAL",
+    "GETTABUP", "GETTABLE", "GETI", "GETFIELD", "SETTABUP",
+    "SETTABLE", "SETI", "SETFIELD", "NEWTABLE", "SELF", "ADDI",
+    "ADDK", "SUBK", "MULK", "MODK", "POWK", "DIVK", "IDIVK", "BANDK",
+    "BORK", "BXORK", "SHRI", "SHLI", "ADD", "SUB", "MUL", "MOD", "POW",
+    "DIV", "IDIV", "BAND", "BOR", "BXOR", "SHL", "SHR", "MMBIN",
+    "MMBINI", "MMBINK", "UNM", "BNOT", "NOT", "LEN", "CONCAT", "CLOSE",
+    "TBC", "JMP", "EQ", "LT", "LE", "EQK", "EQI", "LTI", "LEI", "GTI",
+    "GEI", "TEST", "TESTSET", "CALL", "TAILCALL", "RETURN", "RETURN0",
+    "RETURN1", "FORLOOP", "FORPREP", "TFORPREP", "TFORCALL",
+    "TFORLOOP", "SETLIST", "CLOSURE", "VARARG", "VARARGPREP",
+    "EXTRAARG",
+  },
+}
+
+
+-- instructions that (may) allocate memory
+local reasons = {
+  NEWTABLE = "table constructor",
+  CONCAT = "string concatenation",
+  CLOSURE = "closure creation",
+  SETTABLE = "table write (allocates if the key is new)",
+  SETFIELD = "table write (allocates if the key is new)",
+  SETI = "table write (allocates if the key is new)",
+  SETTABUP = "table write (allocates if the key is new)",
+  SETGLOBAL = "table write (allocates if the key is new)",
+}
+
+
+local function reader( s )
+  local self, pos, little = {}, 1, true
+
+  function self.byte()
+    local b = byte( s, pos )
+    if not b then error( "truncated bytecode", 0 ) end
+    pos = pos + 1
+    return b
+  end
+
+  function self.skip( n )
+    pos = pos + n
+  end
+
+  function self.bytes( n )
+    local str = sub( s, pos, pos+n-1 )
+    if #str ~= n then error( "truncated bytecode", 0 ) end
+    pos = pos + n
+    return str
+  end
+
+  function self.setlittle( v )
+    little = v
+  end
+
+  -- unsigned integer with n bytes in the byte order of the dump
+  function self.uint( n )
+    local v, first, last, step = 0, pos+n-1, pos, -1
+    if not little then first, last, step = last, first, 1 end
+    if pos+n-1 > #s then error( "truncated bytecode", 0 ) end
+    for i = first, last, step do
+      v = v * 256 + byte( s, i )
+    end
+    pos = pos + n
+    return v
+  end
+
+  -- variable length unsigned integer (Lua 5.4)
+  function self.varint()
+    local v, b = 0, 0
+    repeat
+      b = self.byte()
+      v = v * 128 + b % 128
+    until b >= 128
+    return v
+  end
+
+  return self
+end
+
+
+-- version-specific parts of the dump format
+local formats = {}
+
+formats[ 0x51 ] = {
+  header = function( r, h )
+    r.skip( 1 ) -- format
+    r.setlittle( r.byte() == 1 )
+    h.sint = r.byte()
+    h.ssize = r.byte()
+    h.sinstr = r.byte()
+    h.snumber = r.byte()
+    r.skip( 1 ) -- integral flag
+  end,
+  string = function( r, h )
+    local n = r.uint( h.ssize )
+    if n > 0 then return sub( r.bytes( n ), 1, -2 ) end
+  end,
+  int = function( r, h ) return r.uint( h.sint ) end,
+  constant = function( r, h )
+    local t = r.byte()
+    if t == 1 then r.skip( 1 )
+    elseif t == 3 then r.skip( h.snumber )
+    elseif t == 4 then return h.string( r, h )
+    elseif t ~= 0 then error( "invalid constant type", 0 ) end
+  end,
+}
+
+formats[ 0x52 ] = {
+  header = function( r, h )
+    formats[ 0x51 ].header( r, h )
+    r.skip( 6 ) -- LUAC_TAIL
+  end,
+  string = formats[ 0x51 ].string,
+  int = formats[ 0x51 ].int,
+  constant = formats[ 0x51 ].constant,
+}
+
+formats[ 0x53 ] = {
+  header = function( r, h )
+    r.skip( 7 ) -- format, LUAC_DATA
+    h.sint = r.byte()
+    h.ssize = r.byte()
+    h.sinstr = r.byte()
+    h.sinteger = r.byte()
+    h.snumber = r.byte()
+    r.setlittle( r.byte() == 0x78 ) -- first byte of LUAC_INT
+    r.skip( h.sinteger-1+h.snumber+1 ) -- LUAC_INT, LUAC_NUM, nupvals
+  end,
+  string = function( r, h )
+    local n = r.byte()
+    if n == 0xFF then n = r.uint( h.ssize ) end
+    if n > 0 then return r.bytes( n-1 ) end
+  end,
+  int = formats[ 0x51 ].int,
+  constant = function( r, h )
+    local t = r.byte()
+    if t == 1 then r.skip( 1 )
+    elseif t == 3 then r.skip( h.snumber )
+    elseif t == 19 then r.skip( h.sinteger )
+    elseif t == 4 or t == 20 then return h.string( r, h )
+    elseif t ~= 0 then error( "invalid constant type", 0 ) end
+  end,
+}
+
+formats[ 0x54 ] = {
+  header = function( r, h )
+    r.skip( 7 ) -- format, LUAC_DATA
+    h.sinstr = r.byte()
+    h.sinteger = r.byte()
+    h.snumber = r.byte()
+    r.setlittle( r.byte() == 0x78 ) -- first byte of LUAC_INT
+    r.skip( h.sinteger-1+h.snumber+1 ) -- LUAC_INT, LUAC_NUM, nupvals
+  end,
+  string = function( r )
+    local n = r.varint()
+    if n > 0 then return r.bytes( n-1 ) end
+  end,
+  int = function( r ) return r.varint() end,
+  constant = function( r, h )
+    local t = r.byte()
+    if t == 3 then r.skip( h.sinteger )
+    elseif t == 19 then r.skip( h.snumber )
+    elseif t == 4 or t == 20 then return h.string( r, h )
+    elseif t ~= 0 and t ~= 1 and t ~= 17 then
+      error( "invalid constant type", 0 )
+    end
+  end,
+}
+
+
+local function decode( h, i )
+  if h.version == 0x54 then
+    return i % 128, floor( i / 128 ) % 256, floor( i / 65536 ) % 256,
+           floor( i / 16777216 ), floor( i / 32768 )
+  else
+    return i % 64, floor( i / 64 ) % 256, floor( i / 8388608 ),
+           floor( i / 16384 ) % 512, floor( i / 16384 )
+  end
+end
+
+
+-- upvalue descriptors (Lua 5.2+): does the upvalue refer to a local
+-- variable of the enclosing function, and which one (or which
+-- upvalue of the enclosing function)
+local function readupvals( r, h )
+  local upvals = {}
+  for i = 1, h.int( r, h ) do
+    upvals[ i ] = { instack = r.byte(), idx = r.byte() }
+    if h.version == 0x54 then r.skip( 1 ) end -- kind
+  end
+  return upvals
+end
+
+
+local function readproto( r, h, psource )
+  local p = { code = {}, k = {}, protos = {}, lines = {} }
+  local v, int = h.version, h.int
+  if v ~= 0x52 then p.source = h.string( r, h ) or psource end
+  p.linedefined = int( r, h )
+  p.lastlinedefined = int( r, h )
+  if v == 0x51 then p.nups = r.byte() end
+  p.numparams = r.byte()
+  p.is_vararg = r.byte()
+  p.maxstacksize = r.byte()
+  for i = 1, int( r, h ) do p.code[ i ] = r.uint( h.sinstr ) end
+  for i = 1, int( r, h ) do p.k[ i ] = h.constant( r, h ) or false end
+  if v >= 0x53 then p.upvals = readupvals( r, h ) end
+  for i = 1, int( r, h ) do p.protos[ i ] = readproto( r, h, p.source ) end
+  if v == 0x52 then
+    p.upvals = readupvals( r, h )
+    p.source = h.string( r, h ) or psource
+  end
+  -- debug information
+  if v == 0x54 then
+    local deltas, line, abs = {}, p.linedefined, 1
+    for i = 1, int( r, h ) do deltas[ i ] = r.byte() end
+    local abslines = {}
+    for i = 1, int( r, h ) do
+      r.varint() -- pc
+      abslines[ i ] = r.varint()
+    end
+    for i = 1, #deltas do
+      local d = deltas[ i ]
+      if d == 0x80 then -- ABSLINEINFO
+        line, abs = abslines[ abs ], abs + 1
+      else
+        line = line + (d < 0x80 and d or d - 256)
+      end
+      p.lines[ i ] = line
+    end
+  else
+    for i = 1, int( r, h ) do p.lines[ i ] = int( r, h ) end
+  end
+  for i = 1, int( r, h ) do
+    h.string( r, h )
+    int( r, h )
+    int( r, h )
+  end
+  for i = 1, int( r, h ) do h.string( r, h ) end
+  return p
+end
+
+
+local function parse( f )
+  local s = dump( f )
+  if sub( s, 1, 4 ) ~= "\27Lua" then
+    error( "unsupported bytecode format", 0 )
+  end
+  local r = reader( s )
+  r.skip( 4 )
+  local h = { version = r.byte() }
+  local fmt = formats[ h.version ]
+  if not fmt then error( "unsupported Lua version", 0 ) end
+  h.opnames, h.string, h.int, h.constant =
+    opnames[ h.version ], fmt.string, fmt.int, fmt.constant
+  fmt.header( r, h )
+  if h.sinstr ~= 4 then error( "unsupported instruction size", 0 ) end
+  return readproto( r, h ), h
+end
+
+
+local function shortsrc( source )
+  local c = sub( source or "?", 1, 1 )
+  if c == "@" or c == "=" then
+    return sub( source, 2 )
+  else
+    return "[string]"
+  end
+end
+
+
+-- returns a function that maps (0-based) upvalue indices of the
+-- closure `f` to the upvalues' values
+local function upvalues( f )
+  return function( b )
+    local _, v = getupvalue( f, b+1 )
+    return v
+  end
+end
+
+
+-- returns a function that maps upvalue indices of the `i`-th nested
+-- prototype `q` of `p` to the values of the upvalues (given `upval`
+-- for `p`); upvalues that refer to local variables of `p` are unknown
+local function nested( h, p, i, q, upval )
+  local map = {}
+  if h.version == 0x51 then -- pseudo instructions after CLOSURE
+    for pc = 1, #p.code do
+      local op, _, _, _, bx = decode( h, p.code[ pc ] )
+      if h.opnames[ op+1 ] == "CLOSURE" and bx == i-1 then
+        for j = 1, q.nups do
+          local op2, _, b2 = decode( h, p.code[ pc+j ] )
+          if h.opnames[ op2+1 ] == "GETUPVAL" then map[ j-1 ] = b2 end
+        end
+        break
+      end
+    end
+  else
+    for j = 1, #q.upvals do
+      local uv = q.upvals[ j ]
+      if uv.instack == 0 then map[ j-1 ] = uv.idx end
+    end
+  end
+  return function( b )
+    if map[ b ] then return upval( map[ b ] ) end
+  end
+end
+
+
+-- collect Lua functions referenced via upvalues or global variables
+-- in the prototype `p` of the closure `f` (not in nested prototypes)
+local function callees( f, p, h, found, upval )
+  local v = h.version
+  for pc = 1, #p.code do
+    local op, a, b, c, bx = decode( h, p.code[ pc ] )
+    local name, value = h.opnames[ op+1 ]
+    if name == "GETUPVAL" then
+      value = upval( b )
+    elseif name == "GETGLOBAL" then
+      local env = getfenv( f )
+      if type( env ) == "table" and type( p.k[ bx+1 ] ) == "string" then
+        value = rawget( env, p.k[ bx+1 ] )
+      end
+    elseif name == "GETTABUP" then
+      local key
+      if v == 0x54 then
+        key = p.k[ c+1 ]
+      elseif c >= 256 then
+        key = p.k[ c-256+1 ]
+      end
+      local env = upval( b )
+      if type( env ) == "table" and type( key ) == "string" then
+        value = rawget( env, key )
+      end
+    end
+    if type( value ) == "function" then
+      found[ #found+1 ] = value
+    end
+  end
+  return found
+end
+
+
+-- same for `p` and all its nested prototypes
+local function allcallees( f, p, h, found, upval )
+  callees( f, p, h, found, upval )
+  for i = 1, #p.protos do
+    local q = p.protos[ i ]
+    allcallees( f, q, h, found, nested( h, p, i, q, upval ) )
+  end
+  return found
+end
+
+
+local function check( p, h, findings )
+  local src = shortsrc( p.source )
+  for pc = 1, #p.code do
+    local op = decode( h, p.code[ pc ] )
+    local name = h.opnames[ op+1 ]
+    local reason = reasons[ name ]
+    if name == "VARARG" and pc < #p.code and
+       h.opnames[ decode( h, p.code[ pc+1 ] )+1 ] == "SETLIST" then
+      reason = "vararg values stored into a table"
+    end
+    if reason then
+      findings[ #findings+1 ] = {
+        source = src,
+        line = p.lines[ pc ] or p.linedefined,
+        opcode = name,
+        reason = reason,
+      }
+    end
+  end
+  for i = 1, #p.protos do
+    check( p.protos[ i ], h, findings )
+  end
+  return findings
+end
+
+
+local function analyze( f, findings, seen )
+  if seen[ f ] or getinfo( f, "S" ).what == "C" then
+    return findings
+  end
+  seen[ f ] = true
+  local p, h = parse( f )
+  check( p, h, findings )
+  local fs = allcallees( f, p, h, {}, upvalues( f ) )
+  for i = 1, #fs do
+    analyze( fs[ i ], findings, seen )
+  end
+  return findings
+end
+
+
+-- stack slots available to C functions
+local LUA_MINSTACK = 20
+
+local reserve
+
+-- stack slots and call frames needed by a call of the prototype `p`
+-- of the closure `f`: its own stack slots, plus the maximum needed by
+-- the functions it calls and the closures it creates
+local function protoreserve( f, p, h, upval, cache, active )
+  local slots, frames = 0, 0
+  local fs = callees( f, p, h, {}, upval )
+  for i = 1, #fs do
+    local s, n = reserve( fs[ i ], cache, active )
+    if s > slots then slots = s end
+    if n > frames then frames = n end
+  end
+  for i = 1, #p.protos do
+    local q = p.protos[ i ]
+    local s, n = protoreserve( f, q, h, nested( h, p, i, q, upval ),
+                               cache, active )
+    if s > slots then slots = s end
+    if n > frames then frames = n end
+  end
+  local own = p.maxstacksize
+  if p.is_vararg ~= 0 then -- fixed parameters are copied
+    own = own + p.numparams + 1
+  end
+  return own+slots, frames+1
+end
+
+
+function reserve( f, cache, active )
+  local c = cache[ f ]
+  if c then return c[ 1 ], c[ 2 ] end
+  if getinfo( f, "S" ).what == "C" then return LUA_MINSTACK, 1 end
+  if active[ f ] then
+    error( "recursive functions can't be sized statically", 0 )
+  end
+  active[ f ] = true
+  local p, h = parse( f )
+  local slots, frames = protoreserve( f, p, h, upvalues( f ), cache,
+                                      active )
+  active[ f ] = nil
+  cache[ f ] = { slots, frames }
+  return slots, frames
+end
+
+
+local M = {}
+-- results are cached per closure, not per prototype: the functions
+-- referenced via upvalues (and thus the reservation) can differ
+-- between closures of the same prototype
+local cache = setmetatable( {}, { __mode = "k" } )
+
+function M.analyze( f )
+  if type( f ) ~= "function" then
+    error( "bad argument #1 to 'analyze' (function expected)", 2 )
+  end
+  return analyze( f, {}, setmetatable( {}, { __mode = "k" } ) )
+end
+
+function M.reserve( f )
+  if type( f ) ~= "function" then
+    error( "bad argument #1 to 'reserve' (function expected)", 2 )
+  end
+  return reserve( f, cache, {} )
+end
+
+return M
@@ -1,9 +1,11 @@
 #!/usr/bin/lua
+local path = package.path
 if arg[ 1 ] ~= "L" then
   package.path = ""
 end
 
 local finally = require( "finally" )
+package.path = "./?.lua;" .. path -- for `finally.analyze`
 
 
 local function create_a( raise )
@@ -67,7 +69,7 @@ local function main1( r1, r2, r3, r4, stack, calls, dbg )
     return 1, 2, 3
   end, function( ... )
     print( "error?", ... )
-    wastememory( 5 )
+    finally.log( "wasted ", wastememory( 5 ), " call frames\n" )
     if c then c:destroy() end
     if r4 then error( "error in finally cleanup function" ) end
     if b then b:clear() end
@@ -107,4 +109,344 @@ ___()
 print( xpcall( main1, tb, false, false, false, false, 80, 3, true ) )
 ___()
 print( xpcall( main1, tb, false, false, false, false, 1000001, 6, true ) )
+___()
+print( pcall( finally, function()
+  print( "ok" )
+end, function( e, released )
+  finally.log( "error? ", e, "\n" )
+  released.a = true
+  released.b = true
+  released[ 1 ] = "a"
+  released[ 2 ] = "b"
+  finally.log( "released ", released[ 1 ], " and ", released[ 2 ], "\n" )
+end, { narr = 2, nrec = 2, debug = true, nogc = true } ) )
 
+___()
+for _,f in ipairs( finally.analyze( function( e )
+  local t = { e }
+  print( "error? " .. tostring( e ) )
+  t.x = wastememory( 1 )
+end ) ) do
+  print( f.source, f.line, f.opcode, f.reason )
+end
+___()
+print( finally.reserve( function( e )
+  if e then print( "error?", e ) end
+end ) )
+do -- functions called from nested closures are analyzed as well
+  local function helper() return { "allocates" } end
+  local found = false
+  for _,f in ipairs( finally.analyze( function()
+    local function g() return helper() end
+    return g()
+  end ) ) do
+    found = found or f.line == debug.getinfo( helper, "S" ).linedefined
+  end
+  assert( found )
+end
+do -- nested closures need their own slots and call frames
+  local s1, c1 = finally.reserve( function() end )
+  local s2, c2 = finally.reserve( function()
+    local function g()
+      local function h( a, b, c ) return a, b, c end
+      return h( 1, 2, 3 )
+    end
+    return g()
+  end )
+  assert( s2 > s1 and c2 == c1+2 )
+  print( s1, c1, s2, c2 )
+end
+if finally.scratch then
+  ___()
+  local buf
+  print( pcall( finally, function()
+    buf = finally.scratch( 16 )
+    buf:set( 1, "hello" )
+    buf:set( -5, "world" )
+    print( #buf, buf:sub( 1, 5 ), buf:byte( -5, -1 ) )
+  end, function( e )
+    print( "error?", e, buf:sub( -5 ) )
+  end ) )
+  print( pcall( buf.size, buf ) )
+end
+if finally.pool then
+  ___()
+  local n = 0
+  local pool = finally.pool( function()
+    n = n + 1
+    return { id = n }
+  end, function( o )
+    print( "reset", o.id )
+  end, 1 )
+  for i = 1, 3 do
+    print( pcall( finally, function()
+      local a, b = pool:acquire(), pool:acquire()
+      print( "acquired", a.id, b.id )
+    end, function( e )
+      print( "error?", e )
+    end ) )
+  end
+  print( pool:stats() )
+end
+if finally.cancel and _VERSION ~= "Lua 5.1" then
+  ___()
+  local co = coroutine.create( function()
+    return finally( function()
+      finally( function()
+        coroutine.yield( "suspended" )
+      end, function( e )
+        print( "inner cleanup", e )
+      end )
+    end, function( e )
+      print( "outer cleanup", e )
+    end )
+  end )
+  print( coroutine.resume( co ) )
+  print( finally.cancel( co ) )
+end
+if finally.cancel and coroutine.close then
+  ___()
+  local co = coroutine.create( function()
+    return finally( function()
+      coroutine.yield( "suspended" )
+    end, function( e )
+      print( "cleanup", e )
+    end )
+  end )
+  print( coroutine.resume( co ) )
+  print( coroutine.close( co ) )
+end
+if finally.observe then
+  ___()
+  finally.observe( 1 )
+  print( pcall( finally, function()
+    print( "ok" )
+  end, function( e )
+    local t = { e }
+  end ) )
+  -- nested `finally` call in an observed cleanup function
+  print( pcall( finally, function()
+    print( "ok" )
+  end, function( e )
+    finally( function()
+      local t = { "main" }
+    end, function( e )
+      local t = { "inner" }
+    end )
+    local t = { "outer" }
+  end ) )
+  finally.observe( 0 )
+  local sites, dropped = finally.violations()
+  for _,site in ipairs( sites ) do
+    print( site.source, site.line, site.count, site.bytes )
+  end
+  print( "dropped", dropped )
+end
+if finally.profile then
+  ___()
+  finally.profile( true )
+  for i = 1, 3 do
+    finally( function()
+      local t = {}
+      for j = 1, i*10 do t[ j ] = j end
+    end, function() end )
+  end
+  -- allocations of loop bodies are attributed to the body
+  local function body( i )
+    local t = { i, i }
+  end
+  finally.loop( 3, body, function() end )
+  finally.profile( false )
+  local sites, dropped = finally.hotspots( 5 )
+  local found = false
+  for _,site in ipairs( sites ) do
+    print( site.source, site.line, site.count, site.bytes )
+    found = found or site.line == debug.getinfo( body, "S" ).linedefined
+  end
+  assert( found )
+  print( "dropped", dropped )
+end
+if finally.sample then
+  ___()
+  finally.sample( 10 )
+  print( pcall( finally, function()
+    print( "ok" )
+  end, function( e )
+    wastememory( 10 )
+  end ) )
+  finally.sample( 0 )
+  io.write( finally.stacks() )
+end
+if finally.drain then
+  ___()
+  print( pcall( finally, function()
+    finally( function()
+      print( finally.drain() )
+    end, function( e )
+      print( "inner cleanup", e )
+    end )
+  end, function( e )
+    print( "outer cleanup", e )
+  end ) )
+  if finally.pool then -- pooled objects of drained calls aren't reused
+    local pool = finally.pool( function() return {} end )
+    local a, b
+    print( pcall( finally, function()
+      a = pool:acquire()
+      finally.drain()
+      assert( not pcall( pool.acquire, pool ) )
+    end, function() end ) )
+    print( pcall( finally, function()
+      b = pool:acquire()
+    end, function() end ) )
+    assert( a ~= b )
+  end
+end
+if finally.nursery then
+  ___()
+  print( pcall( finally.nursery, function( spawn )
+    local co = spawn( function()
+      coroutine.yield( "suspended" )
+      print( "not reached" )
+    end )
+    print( coroutine.resume( co ) )
+    error( "error in nursery" )
+  end ) )
+  -- C version: protected calls are unwound (Lua 5.1 can't yield
+  -- across `pcall`, so there are no protected calls to unwind)
+  if finally.scratch and _VERSION ~= "Lua 5.1" then
+    local cleaned
+    print( pcall( finally.nursery, function( spawn )
+      local co = spawn( function()
+        local ok, e = pcall( function()
+          coroutine.yield()
+        end )
+        cleaned = e
+      end )
+      coroutine.resume( co )
+    end ) )
+    assert( cleaned == "closed" )
+    -- a child that yields again after catching the error is closed
+    -- as well
+    local rounds, child = 0, nil
+    print( pcall( finally.nursery, function( spawn )
+      child = spawn( function()
+        pcall( function()
+          coroutine.yield()
+        end )
+        rounds = rounds + 1
+        coroutine.yield()
+        rounds = rounds + 1
+      end )
+      coroutine.resume( child )
+    end ) )
+    assert( rounds == 1 and coroutine.status( child ) == "dead" )
+  end
+end
+___()
+local function release( e, a, b )
+  print( "error?", e, "results", a, b )
+end
+print( pcall( finally, function()
+  return "a", "b"
+end, release, { results = true } ) )
+if finally.scratch then -- C version: too many results for reservation
+  local got
+  local ok, e = pcall( finally, function()
+    return 1, 2, 3
+  end, function( e, a )
+    got = e or a
+  end, { results = 2 } )
+  assert( not ok and got == e )
+  print( ok, e )
+  -- no scope is left behind if results don't fit on the stack
+  local t, unpack = {}, table.unpack or unpack
+  for i = 1, 200000 do t[ i ] = i end
+  ok, e = pcall( finally, function()
+    return unpack( t )
+  end, function() end, { results = 2 } )
+  assert( not ok and e:match( "too many results" ) )
+  assert( finally.drain() == 0 )
+  ok, e = pcall( finally.scratch, 1 )
+  assert( not ok and e:match( "no active 'finally' call" ) )
+  print( ok, e )
+end
+if finally.transaction then
+  ___()
+  local function commit( e, a ) print( "commit", e, a ) end
+  local function rollback( e ) print( "rollback", e ) end
+  print( pcall( finally.transaction, function()
+    return "a"
+  end, commit, rollback, { results = true } ) )
+  print( pcall( finally.transaction, function()
+    error( "error in transaction" )
+  end, commit, rollback, { error = { stack = 200, calls = 20 } } ) )
+  -- without options only the matching branch runs
+  local committed, rolledback = 0, 0
+  assert( finally.transaction( function()
+    return "ok"
+  end, function( e )
+    assert( e == nil )
+    committed = committed + 1
+  end, function()
+    rolledback = rolledback + 1
+  end ) == "ok" )
+  assert( not pcall( finally.transaction, function()
+    error( "fail" )
+  end, function()
+    committed = committed + 1
+  end, function( e )
+    rolledback = rolledback + 1
+  end ) )
+  assert( committed == 1 and rolledback == 1 )
+  print( "commit/rollback", committed, rolledback )
+end
+if finally.loop then
+  ___()
+  local sum = 0
+  print( pcall( finally.loop, 5, function( i )
+    sum = sum + i
+    if i == 4 then error( "error in iteration " .. i ) end
+  end, function( e )
+    print( "cleanup", sum, e )
+  end, { stack = 10, calls = 2 } ) )
+  local total = 0
+  finally.loop( 3, function( i )
+    return i, i*i
+  end, function( e, a, b )
+    total = total + a + b
+  end, { results = 2 } )
+  assert( total == 1+1 + 2+4 + 3+9 )
+  print( "loop results", total )
+end
+if finally.open then
+  ___()
+  local f
+  print( pcall( finally, function()
+    f = assert( finally.open( "test.lua" ) )
+    print( f:read( "*l" ) )
+  end, function() end ) )
+  print( io.type( f ) )
+end
+if finally.mmap then
+  ___()
+  local m
+  print( pcall( finally, function()
+    m = assert( finally.mmap( "test.lua", 2, 14 ) )
+    print( #m, m:byte( 1 ), m:sub() )
+  end, function() end ) )
+  print( pcall( m.size, m ) )
+end
+if finally.prefault then -- last, because it replaces the allocator
+  ___()
+  print( finally.prefault( 256*1024 ) )
+  assert( not pcall( finally.prefault, 1024 ) )
+  for i = 1, 3 do
+    print( pcall( finally, function()
+      return i
+    end, function( e )
+      print( "error?", e, wastememory( 5 ) )
+    end, { stack = 1000, calls = 20, debug = true } ) )
+  end
+  collectgarbage()
+end